@@ -0,0 +1,264 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+/*
+ * The manager's translation cache is shared by all its address spaces. An entry is tagged with
+ * the ASID and that ASID's generation when it was filled, and only counts while the generation
+ * is current, so invalidating an address space (or recycling its ASID) is a single increment
+ * and its stale entries are simply replaced as the sets fill up again.
+ */
+
+struct as_entry
+{
+    uint64_t key; // vpn | asid << AS_VPN_BITS
+    uint64_t ppn;
+    uint32_t generation; // 0 means the entry is empty
+    uint64_t stamp;      // Last use, for LRU within the set
+};
+
+#define AS_VPN_BITS (PT_LEVELS * SYMBOL_BITS)
+
+struct pt_as_manager
+{
+    struct as_entry *entries;
+    unsigned int sets;
+    unsigned int ways;
+    uint64_t clock;
+    int current; // The ASID translations go to, -1 before the first switch
+
+    uint64_t tables[PT_MAX_ASIDS];      // Root of every live ASID, NO_MAPPING when free
+    uint32_t generations[PT_MAX_ASIDS]; // Never 0
+    int next_free;                      // ASIDs are recycled from the lowest free one
+    struct pt_as_stats stats;
+};
+
+static inline uint64_t as_key(int asid, uint64_t vpn)
+{
+    return (vpn & ((1ULL << AS_VPN_BITS) - 1)) | ((uint64_t)asid << AS_VPN_BITS);
+}
+
+static inline struct as_entry *as_set(struct pt_as_manager *m, uint64_t key)
+{
+    return &m->entries[(hash_key(key) >> 32 & (m->sets - 1)) * m->ways];
+}
+
+static struct as_entry *as_find(struct pt_as_manager *m, int asid, uint64_t vpn)
+{
+    uint64_t key = as_key(asid, vpn);
+    struct as_entry *set = as_set(m, key);
+
+    for (unsigned int i = 0; i < m->ways; i++)
+    {
+        if (set[i].key == key && set[i].generation == m->generations[asid])
+        {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+static int current_asid(struct pt_as_manager *m)
+{
+    if (m->current < 0)
+        errx(1, "pt_as: no address space is current");
+    return m->current;
+}
+
+struct pt_as_manager *pt_as_manager_create(unsigned int sets, unsigned int ways)
+{
+    if (sets == 0 || (sets & (sets - 1)) != 0 || ways == 0)
+        errx(1, "pt_as_manager_create: sets must be a power of 2 and ways must be positive");
+    if (pt_concurrent)
+        errx(1, "pt_as_manager_create: address spaces can't be managed in concurrent mode");
+
+    struct pt_as_manager *m = calloc(1, sizeof(struct pt_as_manager));
+    if (m == NULL || (m->entries = calloc((size_t)sets * ways, sizeof(struct as_entry))) == NULL)
+        err(1, "pt_as_manager_create: calloc failed");
+
+    m->sets = sets;
+    m->ways = ways;
+    m->current = -1;
+    for (int asid = 0; asid < PT_MAX_ASIDS; asid++)
+    {
+        m->tables[asid] = NO_MAPPING;
+        m->generations[asid] = 1;
+    }
+    return m;
+}
+
+int pt_as_create(struct pt_as_manager *m)
+{
+    while (m->next_free < PT_MAX_ASIDS && m->tables[m->next_free] != NO_MAPPING)
+    {
+        m->next_free++;
+    }
+    if (m->next_free == PT_MAX_ASIDS)
+        errx(1, "pt_as_create: all %d ASIDs are in use", PT_MAX_ASIDS);
+
+    int asid = m->next_free++;
+    m->tables[asid] = alloc_page_frame();
+    return asid;
+}
+
+/**
+ * Drops a mapping of a table being destroyed from the reverse map. Huge blocks are never in it.
+ */
+static int forget_mapping(uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg)
+{
+    if (pages == 1)
+    {
+        rmap_update(*(uint64_t *)arg, vpn, ppn, NO_MAPPING);
+    }
+    return 0;
+}
+
+void pt_as_destroy(struct pt_as_manager *m, int asid)
+{
+    uint64_t pt = pt_as_table(m, asid);
+    uint64_t *root = (uint64_t *)phys_to_virt(pt << OFFSET_BITS);
+
+    // The root frame may come back as another table, which mustn't inherit these mappings
+    if (rmap_enabled)
+    {
+        page_table_for_each(pt, 0, 1ULL << AS_VPN_BITS, forget_mapping, &pt);
+    }
+
+    for (int j = 0; j <= SYMBOL_MASK; j++)
+    {
+        if (is_valid_pte(root[j]) && !is_huge_pte(root[j]))
+        {
+            free_subtree(get_frame_number(root[j]), 1);
+        }
+    }
+    // The root frame may come back as another table, which mustn't inherit cached walks
+    tlb_invalidate_range(pt, 0, 1ULL << AS_VPN_BITS);
+    psc_invalidate_range(pt, 0, 1ULL << AS_VPN_BITS);
+    free_root(pt);
+
+    pt_as_flush(m, asid);
+    m->tables[asid] = NO_MAPPING;
+    if (asid < m->next_free)
+    {
+        m->next_free = asid;
+    }
+    if (m->current == asid)
+    {
+        m->current = -1;
+    }
+}
+
+void pt_as_manager_destroy(struct pt_as_manager *m)
+{
+    for (int asid = 0; asid < PT_MAX_ASIDS; asid++)
+    {
+        if (m->tables[asid] != NO_MAPPING)
+        {
+            pt_as_destroy(m, asid);
+        }
+    }
+    free(m->entries);
+    free(m);
+}
+
+uint64_t pt_as_table(struct pt_as_manager *m, int asid)
+{
+    if (asid < 0 || asid >= PT_MAX_ASIDS || m->tables[asid] == NO_MAPPING)
+        errx(1, "pt_as: ASID %d isn't in use", asid);
+    return m->tables[asid];
+}
+
+void pt_as_switch(struct pt_as_manager *m, int asid)
+{
+    pt_as_table(m, asid);
+    m->current = asid;
+    m->stats.switches++;
+}
+
+void pt_as_flush(struct pt_as_manager *m, int asid)
+{
+    if (++m->generations[asid] == 0)
+    {
+        // After 2^32 flushes, entries this old could pass for current ones again
+        for (size_t i = 0; i < (size_t)m->sets * m->ways; i++)
+        {
+            if ((m->entries[i].key >> AS_VPN_BITS) == (uint64_t)asid)
+                m->entries[i].generation = 0;
+        }
+        m->generations[asid] = 1;
+    }
+    m->stats.flushes++;
+}
+
+void pt_as_flush_all(struct pt_as_manager *m)
+{
+    for (size_t i = 0; i < (size_t)m->sets * m->ways; i++)
+    {
+        m->entries[i].generation = 0;
+    }
+    m->stats.flushes++;
+}
+
+uint64_t pt_as_query(struct pt_as_manager *m, uint64_t vpn)
+{
+    int asid = current_asid(m);
+    struct as_entry *entry = as_find(m, asid, vpn);
+
+    if (entry != NULL)
+    {
+        m->stats.hits++;
+        entry->stamp = ++m->clock;
+        return entry->ppn;
+    }
+
+    m->stats.misses++;
+    uint64_t ppn = page_table_query(m->tables[asid], vpn);
+    if (ppn == NO_MAPPING)
+    {
+        return ppn;
+    }
+
+    // Pick a way that holds nothing current, otherwise the least recently used one
+    uint64_t key = as_key(asid, vpn);
+    struct as_entry *set = as_set(m, key);
+    struct as_entry *victim = &set[0];
+    for (unsigned int i = 0; i < m->ways; i++)
+    {
+        uint64_t owner = set[i].key >> AS_VPN_BITS;
+        if (set[i].generation != m->generations[owner])
+        {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].stamp < victim->stamp)
+        {
+            victim = &set[i];
+        }
+    }
+    *victim = (struct as_entry){key, ppn, m->generations[asid], ++m->clock};
+    return ppn;
+}
+
+void pt_as_update(struct pt_as_manager *m, uint64_t vpn, uint64_t ppn)
+{
+    int asid = current_asid(m);
+    struct as_entry *entry = as_find(m, asid, vpn);
+
+    page_table_update(m->tables[asid], vpn, ppn);
+    if (entry != NULL)
+    {
+        entry->generation = 0;
+        m->stats.invalidations++;
+    }
+}
+
+void pt_as_get_stats(struct pt_as_manager *m, struct pt_as_stats *stats)
+{
+    *stats = m->stats;
+}
+
+void pt_as_reset_stats(struct pt_as_manager *m)
+{
+    m->stats = (struct pt_as_stats){0};
+}
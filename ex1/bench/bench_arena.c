@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Builds the same table with the per-frame mmap allocator and with the frame arena, and reports
+ * the build time, lookup time and the number of VMAs the process ends up with.
+ * Every mode runs in its own child, since the allocator mode is fixed by the first allocation.
+ *
+ * Usage: bench_arena [mappings] [span_bits]
+ */
+
+static int count_vmas(void)
+{
+    FILE *maps = fopen("/proc/self/maps", "r");
+    int lines = 0;
+    int c;
+
+    if (maps == NULL)
+        return -1;
+    while ((c = fgetc(maps)) != EOF)
+    {
+        lines += (c == '\n');
+    }
+    fclose(maps);
+    return lines;
+}
+
+static void run(const char *mode, uint64_t mappings, int span_bits)
+{
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t span_mask = (1ULL << span_bits) - 1;
+    int vmas_before = count_vmas();
+
+    if (strcmp(mode, "mmap") != 0)
+    {
+        // Every mapping needs at most one frame per level below the root
+        init_page_frame_arena(mappings * (PT_LEVELS - 1) + 1, strcmp(mode, "arena-huge") == 0);
+    }
+
+    uint64_t pt = alloc_page_frame();
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < mappings; i++)
+    {
+        uint64_t vpn = bench_rand(&seed) & span_mask;
+        page_table_update(pt, vpn, vpn + 1);
+    }
+    uint64_t build = now_ns() - start;
+
+    seed = 0x9E3779B97F4A7C15ULL;
+    start = now_ns();
+    for (uint64_t i = 0; i < mappings; i++)
+    {
+        uint64_t vpn = bench_rand(&seed) & span_mask;
+        if (page_table_query(pt, vpn) != vpn + 1)
+            errx(1, "%s: wrong translation of vpn %llx", mode, (unsigned long long)vpn);
+    }
+    uint64_t query = now_ns() - start;
+
+    struct pt_footprint footprint;
+    pt_get_footprint(&footprint);
+    printf("%-11s build %9.1f ms (%7.1f ns/map)  query %7.1f ns  %8llu frames  %6d VMAs\n", mode, build / 1e6,
+           (double)build / mappings, (double)query / mappings, (unsigned long long)footprint.node_frames + 1,
+           count_vmas() - vmas_before);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 18;
+    int span_bits = (argc > 2) ? atoi(argv[2]) : 30;
+    const char *modes[] = {"mmap", "arena", "arena-huge"};
+
+    for (int i = 0; i < 3; i++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+            err(1, "fork failed");
+        if (pid == 0)
+        {
+            run(modes[i], mappings, span_bits);
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errx(1, "%s run failed", modes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Runs a round-robin schedule over many address spaces, each touching its own working set for a
+ * quantum of accesses before the next switch, with an ASID-tagged cache and with one that is
+ * flushed on every switch. Reports the hit rate of both and what a switch costs: the switch itself,
+ * and the misses that follow a flush, as the extra time per switch over the tagged run.
+ *
+ * Usage: bench_asid [spaces] [pages] [quantum] [switches]
+ */
+
+int main(int argc, char **argv)
+{
+    int spaces = (argc > 1) ? atoi(argv[1]) : 256;
+    uint64_t pages = (argc > 2) ? strtoull(argv[2], NULL, 0) : 32;
+    uint64_t quantum = (argc > 3) ? strtoull(argv[3], NULL, 0) : 64;
+    uint64_t switches = (argc > 4) ? strtoull(argv[4], NULL, 0) : 1 << 16;
+    uint64_t elapsed[2];
+
+    if (spaces <= 0 || spaces > PT_MAX_ASIDS)
+        errx(1, "between 1 and %d address spaces", PT_MAX_ASIDS);
+
+    struct pt_as_manager *m = pt_as_manager_create(1024, 8);
+    int *asids = malloc(spaces * sizeof(int));
+    uint64_t *bases = malloc(spaces * sizeof(uint64_t));
+    if (asids == NULL || bases == NULL)
+        err(1, "malloc failed");
+
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < spaces; i++)
+    {
+        asids[i] = pt_as_create(m);
+        bases[i] = bench_rand(&seed) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1) & ~0xFFFFULL;
+        pt_as_switch(m, asids[i]);
+        for (uint64_t p = 0; p < pages; p++)
+        {
+            pt_as_update(m, bases[i] + p * 17, p);
+        }
+    }
+
+    printf("%d address spaces of %llu pages, %llu accesses per quantum, cache of 1024 x 8\n", spaces,
+           (unsigned long long)pages, (unsigned long long)quantum);
+    printf("%-8s %9s %12s %12s\n", "mode", "hit rate", "ns/access", "ns/switch");
+    for (int flush = 0; flush <= 1; flush++)
+    {
+        struct pt_as_stats stats;
+        uint64_t sum = 0;
+
+        pt_as_flush_all(m);
+        pt_as_reset_stats(m);
+        seed = 0x9E3779B97F4A7C15ULL;
+
+        uint64_t start = now_ns();
+        for (uint64_t s = 0; s < switches; s++)
+        {
+            int i = s % spaces;
+            pt_as_switch(m, asids[i]);
+            if (flush)
+                pt_as_flush_all(m);
+            for (uint64_t a = 0; a < quantum; a++)
+            {
+                sum += pt_as_query(m, bases[i] + (bench_rand(&seed) % pages) * 17);
+            }
+        }
+        elapsed[flush] = now_ns() - start;
+        pt_as_get_stats(m, &stats);
+
+        printf("%-8s %8.2f%% %12.1f %12.1f\n", flush ? "flush" : "tagged",
+               100.0 * stats.hits / (stats.hits + stats.misses), (double)elapsed[flush] / (switches * quantum),
+               flush ? (double)(elapsed[1] - elapsed[0]) / switches : 0.0);
+        if (sum == 0)
+            printf("\n");
+    }
+
+    // The switch alone, without accesses
+    uint64_t start = now_ns();
+    for (uint64_t s = 0; s < switches; s++)
+    {
+        pt_as_switch(m, asids[s % spaces]);
+    }
+    printf("switch   %.1f ns without a flush\n", (double)(now_ns() - start) / switches);
+
+    pt_as_manager_destroy(m);
+    free(asids);
+    free(bases);
+    return 0;
+}
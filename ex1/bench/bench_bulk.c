@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Builds the same table from a sorted list of mappings with page_table_update, and with
+ * page_table_bulk_load on 1, 2, 4, ... threads up to the number of cores, each into a new table.
+ * The mappings come in runs of 512 consecutive pages at random spots. Frames come from the arena,
+ * so that what is measured is building the tables rather than mmap.
+ *
+ * Usage: bench_bulk [mappings] [max_threads]
+ */
+
+int main(int argc, char **argv)
+{
+    size_t n = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 22;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = (argc > 2) ? strtoul(argv[2], NULL, 0) : (cores > 0 ? cores : 1);
+    struct pt_pair *pairs = malloc(n * sizeof(struct pt_pair));
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    if (pairs == NULL)
+        err(1, "malloc failed");
+
+    // Every run needs at most 2 leaves and 3 nodes above them, in each of the tables built
+    unsigned int tables = 2;
+    for (unsigned int threads = 1; threads < max_threads; threads *= 2)
+        tables++;
+    init_page_frame_arena((n / 512 + 1) * 5 * tables + 2 * tables, 0);
+
+    // Sorted by construction: the spots are increasing, and far enough apart for the runs
+    uint64_t spot = 0, gap = (1ULL << (SYMBOL_BITS * PT_LEVELS)) / (n / 512 + 1);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i % 512 == 0)
+            spot += 512 + bench_rand(&seed) % (gap - 512);
+        pairs[i].vpn = spot + i % 512;
+        pairs[i].ppn = i;
+    }
+
+    uint64_t pt = alloc_page_frame();
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        page_table_update(pt, pairs[i].vpn, pairs[i].ppn);
+    }
+    uint64_t sequential = now_ns() - start;
+    printf("%-8s %10s %10s %9s\n", "threads", "ms", "ns/map", "speedup");
+    printf("%-8s %10.1f %10.1f %9.2f\n", "update", sequential / 1e6, (double)sequential / n, 1.0);
+
+    for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        pt = alloc_page_frame();
+        start = now_ns();
+        page_table_bulk_load(pt, pairs, n, threads);
+        uint64_t elapsed = now_ns() - start;
+
+        for (size_t i = 0; i < n; i += 4099)
+        {
+            if (page_table_query(pt, pairs[i].vpn) != pairs[i].ppn)
+                errx(1, "wrong translation of vpn %llx", (unsigned long long)pairs[i].vpn);
+        }
+        printf("%-8u %10.1f %10.1f %9.2f\n", threads, elapsed / 1e6, (double)elapsed / n, (double)sequential / elapsed);
+    }
+
+    free(pairs);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Stress and throughput test of the concurrent mode. Reader threads look up random vpns while
+ * writer threads keep mapping and unmapping vpns of the same span, so readers race with both leaf
+ * updates and node installation. Every vpn is only ever mapped to vpn + 1, so a reader that sees
+ * anything else than that or NO_MAPPING has observed a torn walk.
+ *
+ * Usage: bench_concurrent [max_readers] [writers] [ms_per_run] [span_bits]
+ */
+
+struct worker
+{
+    pthread_t thread;
+    uint64_t pt;
+    uint64_t span_mask;
+    uint64_t seed;
+    uint64_t ops;
+    uint64_t errors;
+};
+
+static atomic_int running;
+
+static void *reader(void *p)
+{
+    struct worker *w = p;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed))
+    {
+        // Check the flag every few lookups only, so that it doesn't dominate the loop
+        for (int i = 0; i < 256; i++)
+        {
+            uint64_t vpn = bench_rand(&w->seed) & w->span_mask;
+            uint64_t ppn = page_table_query(w->pt, vpn);
+            w->errors += (ppn != NO_MAPPING && ppn != vpn + 1);
+        }
+        w->ops += 256;
+    }
+    return NULL;
+}
+
+static void *writer(void *p)
+{
+    struct worker *w = p;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed))
+    {
+        uint64_t vpn = bench_rand(&w->seed) & w->span_mask;
+        page_table_update(w->pt, vpn, (w->ops & 1) ? NO_MAPPING : vpn + 1);
+        w->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * Runs the given number of readers and writers for ms milliseconds and prints their throughput.
+ * Returns the number of inconsistent lookups.
+ */
+static uint64_t run(uint64_t pt, uint64_t span_mask, int readers, int writers, int ms)
+{
+    struct worker *workers = calloc(readers + writers, sizeof(struct worker));
+    if (workers == NULL)
+        err(1, "calloc failed");
+
+    atomic_store(&running, 1);
+    for (int t = 0; t < readers + writers; t++)
+    {
+        workers[t].pt = pt;
+        workers[t].span_mask = span_mask;
+        workers[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        if (pthread_create(&workers[t].thread, NULL, (t < readers) ? reader : writer, &workers[t]) != 0)
+            errx(1, "pthread_create failed");
+    }
+
+    uint64_t start = now_ns();
+    usleep(ms * 1000);
+    atomic_store(&running, 0);
+
+    uint64_t lookups = 0, updates = 0, errors = 0;
+    for (int t = 0; t < readers + writers; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        *((t < readers) ? &lookups : &updates) += workers[t].ops;
+        errors += workers[t].errors;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%7d %7d %14.2f %14.2f %14.2f %8llu\n", readers, writers, lookups / secs / 1e6,
+           readers ? lookups / secs / 1e6 / readers : 0.0, updates / secs / 1e6, (unsigned long long)errors);
+    free(workers);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_readers = (argc > 1) ? atoi(argv[1]) : (int)cores;
+    int writers = (argc > 2) ? atoi(argv[2]) : 2;
+    int ms = (argc > 3) ? atoi(argv[3]) : 500;
+    int span_bits = (argc > 4) ? atoi(argv[4]) : 22;
+    uint64_t span_mask = (1ULL << span_bits) - 1;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    uint64_t errors = 0;
+
+    pt_set_concurrent(1);
+    uint64_t pt = alloc_page_frame();
+
+    // Half populate the span, the writers then keep it at about that density
+    for (uint64_t i = 0; i < (span_mask + 1) / 2; i++)
+    {
+        uint64_t vpn = bench_rand(&seed) & span_mask;
+        page_table_update(pt, vpn, vpn + 1);
+    }
+
+    printf("%ld cores, span of 2^%d vpns, %d ms per run\n", cores, span_bits, ms);
+    printf("%7s %7s %14s %14s %14s %8s\n", "readers", "writers", "Mlookups/s", "per reader", "Mupdates/s",
+           "errors");
+    for (int readers = 1; readers <= max_readers; readers *= 2)
+    {
+        errors += run(pt, span_mask, readers, writers, ms);
+        if (readers * 2 > max_readers && readers != max_readers)
+        {
+            readers = max_readers / 2; // Always finish with max_readers
+        }
+    }
+
+    if (errors != 0)
+        errx(1, "%llu lookups returned a ppn that was never mapped", (unsigned long long)errors);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Builds the same random set of mappings in a table of every geometry, then times lookups and
+ * reports the frames the nodes take. The default geometry runs the general walker; the others
+ * run their own unrolled ones. The mappings cover the same number of pages in every geometry,
+ * so the larger granules also map more memory.
+ *
+ * Usage: bench_geometry [mappings] [span_bits] [lookups]
+ */
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 16;
+    int span_bits = (argc > 2) ? atoi(argv[2]) : 26;
+    size_t lookups = (argc > 3) ? strtoull(argv[3], NULL, 0) : 1 << 22;
+    uint64_t span_mask = (1ULL << span_bits) - 1;
+
+    uint64_t *vpns = malloc(lookups * sizeof(uint64_t));
+    if (vpns == NULL)
+        err(1, "malloc failed");
+
+    printf("%-11s %6s %12s %12s %10s %12s\n", "geometry", "levels", "ns/map", "ns/query", "frames", "bytes/map");
+    for (int g = 0; g < PT_GEOMETRIES; g++)
+    {
+        const struct pt_geometry_info *info = pt_geometry_info(g);
+        uint64_t vpn_bits = info->top_bits + info->symbol_bits * (info->levels - 1);
+        uint64_t mask = (vpn_bits < (uint64_t)span_bits) ? (1ULL << vpn_bits) - 1 : span_mask;
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        struct pt_footprint before, after;
+
+        pt_get_footprint(&before);
+        uint64_t pt = page_table_create(g);
+
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < mappings; i++)
+        {
+            uint64_t vpn = bench_rand(&seed) & mask;
+            page_table_update(pt, vpn, vpn + 1);
+        }
+        uint64_t build = now_ns() - start;
+        pt_get_footprint(&after);
+
+        for (size_t i = 0; i < lookups; i++)
+        {
+            vpns[i] = bench_rand(&seed) & mask;
+        }
+
+        uint64_t hits = 0;
+        start = now_ns();
+        for (size_t i = 0; i < lookups; i++)
+        {
+            hits += page_table_query(pt, vpns[i]) == vpns[i] + 1;
+        }
+        uint64_t query = now_ns() - start;
+        if (hits == 0)
+            errx(1, "%s: no lookup hit a mapping", info->name);
+
+        uint64_t frames = after.node_frames - before.node_frames;
+        printf("%-11s %6d %12.1f %12.1f %10llu %12.1f\n", info->name, info->levels, (double)build / mappings,
+               (double)query / lookups, (unsigned long long)frames, frames * 4096.0 / mappings);
+    }
+
+    free(vpns);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Compares the radix tree with the hashed and the compressed backends on memory per mapping and on update and lookup
+ * cost, for mappings scattered over the whole address space (where every radix mapping needs its
+ * own path of nodes), clustered ones and a dense sequential run.
+ *
+ * Usage: bench_hashed [mappings] [lookups]
+ */
+
+enum pattern
+{
+    Scattered,
+    Clustered,
+    Dense,
+    PATTERNS
+};
+
+static const char *pattern_names[PATTERNS] = {"scattered", "clustered", "dense"};
+
+enum backend
+{
+    Radix,
+    Hashed,
+    Compressed,
+    BACKENDS
+};
+
+static const char *backend_names[BACKENDS] = {"radix", "hashed", "compressed"};
+
+static uint64_t create_table(enum backend backend)
+{
+    switch (backend)
+    {
+    case Hashed:
+        return page_table_create_hashed();
+    case Compressed:
+        return page_table_create_compressed();
+    default:
+        return alloc_page_frame();
+    }
+}
+
+static uint64_t pattern_vpn(enum pattern pattern, uint64_t i, uint64_t *seed)
+{
+    switch (pattern)
+    {
+    case Scattered:
+        return bench_rand(seed) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1);
+    case Clustered:
+        // 64 pages around each of a few scattered spots
+        return ((i / 64 * 0x9E3779B97F4A7C15ULL) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1) & ~0xFFFULL) + i % 64;
+    default:
+        return i;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 14;
+    size_t lookups = (argc > 2) ? strtoull(argv[2], NULL, 0) : 1 << 22;
+    uint64_t *vpns = malloc(mappings * sizeof(uint64_t));
+    uint64_t *order = malloc(lookups * sizeof(uint64_t));
+    if (vpns == NULL || order == NULL)
+        err(1, "malloc failed");
+
+    printf("%-10s %-10s %10s %10s %12s\n", "pattern", "backend", "ns/update", "ns/query", "bytes/map");
+    for (int p = 0; p < PATTERNS; p++)
+    {
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        for (uint64_t i = 0; i < mappings; i++)
+        {
+            vpns[i] = pattern_vpn(p, i, &seed);
+        }
+        for (size_t i = 0; i < lookups; i++)
+        {
+            order[i] = vpns[bench_rand(&seed) % mappings];
+        }
+
+        for (int b = 0; b < BACKENDS; b++)
+        {
+            struct pt_footprint before, after;
+
+            pt_get_footprint(&before);
+            uint64_t pt = create_table(b);
+
+            uint64_t start = now_ns();
+            for (uint64_t i = 0; i < mappings; i++)
+            {
+                page_table_update(pt, vpns[i], vpns[i] + 1);
+            }
+            uint64_t update = now_ns() - start;
+            pt_get_footprint(&after);
+
+            start = now_ns();
+            for (size_t i = 0; i < lookups; i++)
+            {
+                if (page_table_query(pt, order[i]) != order[i] + 1)
+                    errx(1, "wrong translation of vpn %llx", (unsigned long long)order[i]);
+            }
+            uint64_t query = now_ns() - start;
+
+            // The root frame is counted as well, it is all a hashed table's header takes
+            printf("%-10s %-10s %10.1f %10.1f %12.1f\n", pattern_names[p], backend_names[b],
+                   (double)update / mappings, (double)query / lookups,
+                   (after.node_frames - before.node_frames + 1) * 4096.0 / mappings);
+        }
+    }
+
+    free(vpns);
+    free(order);
+    return 0;
+}
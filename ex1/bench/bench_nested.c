@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Translates random pages of a guest working set through a nested table, with neither cache, with
+ * the nested-walk cache only and with both, against a native table holding the same final mappings.
+ * Reports the entries read per translation, the hit rates of both caches and the time per translation.
+ *
+ * Usage: bench_nested [pages] [cache entries] [translations]
+ */
+
+int main(int argc, char **argv)
+{
+    uint64_t pages = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 16;
+    unsigned int entries = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024;
+    uint64_t translations = (argc > 3) ? strtoull(argv[3], NULL, 0) : 1 << 22;
+    uint64_t vpn_mask = (1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1;
+
+    uint64_t *gvpns = malloc(pages * sizeof(uint64_t));
+    if (gvpns == NULL)
+        err(1, "malloc failed");
+
+    // Guest RAM is gppns [0, pages), and the guest maps it in runs of 64 pages all over its space
+    uint64_t host = page_table_create(PT_GEOMETRY_DEFAULT);
+    uint64_t native = page_table_create(PT_GEOMETRY_DEFAULT);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (uint64_t p = 0; p < pages; p++)
+    {
+        gvpns[p] = (p % 64) ? gvpns[p - 1] + 1 : bench_rand(&seed) & vpn_mask & ~63ULL;
+        page_table_update(host, p, 0x100000 + p);
+        page_table_update(native, gvpns[p], 0x100000 + p);
+    }
+
+    struct
+    {
+        const char *name;
+        unsigned int combined;
+        unsigned int nwc;
+    } modes[] = {{"none", 0, 0}, {"nwc", 0, entries}, {"both", entries, entries}};
+
+    printf("%llu guest pages, %u cache entries, %llu translations\n", (unsigned long long)pages, entries,
+           (unsigned long long)translations);
+    printf("%-8s %10s %10s %10s %12s\n", "mode", "refs/xlat", "combined", "nwc", "ns/xlat");
+
+    uint64_t sum = 0;
+    seed = 1;
+    uint64_t start = now_ns();
+    for (uint64_t t = 0; t < translations; t++)
+    {
+        sum += page_table_query(native, gvpns[bench_rand(&seed) % pages]);
+    }
+    printf("%-8s %10d %10s %10s %12.1f\n", "native", PT_LEVELS, "-", "-",
+           (double)(now_ns() - start) / translations);
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        struct pt_nested_stats stats;
+        struct pt_nested *n = pt_nested_create(host, pages + i * pages, modes[i].combined, modes[i].nwc);
+
+        for (uint64_t p = 0; p < pages; p++)
+        {
+            pt_nested_map(n, gvpns[p], p);
+        }
+        pt_nested_reset_stats(n);
+
+        seed = 1;
+        start = now_ns();
+        for (uint64_t t = 0; t < translations; t++)
+        {
+            sum += pt_nested_translate(n, gvpns[bench_rand(&seed) % pages]);
+        }
+        uint64_t elapsed = now_ns() - start;
+        pt_nested_get_stats(n, &stats);
+
+        uint64_t host_walks = stats.nwc_hits + stats.nwc_misses;
+        printf("%-8s %10.2f %9.2f%% %9.2f%% %12.1f\n", modes[i].name, (double)stats.references / translations,
+               100.0 * stats.combined_hits / translations,
+               host_walks ? 100.0 * stats.nwc_hits / host_walks : 0.0, (double)elapsed / translations);
+        pt_nested_destroy(n);
+    }
+    if (sum == 0)
+        printf("\n");
+
+    free(gvpns);
+    return 0;
+}
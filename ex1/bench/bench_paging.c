@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Runs the same access stream through a pager of every replacement policy, and reports the fault
+ * rate, the writebacks and the cost of the accesses and of fault handling.
+ *
+ * The stream is the queries (reads) and updates (writes) of a trace recorded with pt_trace_start,
+ * ignoring unmaps and tables, or else a synthetic one: 80% of the accesses to a hot fifth of the
+ * pages, the rest spread over all of them, with a sequential scan over fresh pages now and then.
+ *
+ * Usage: bench_paging [frames] [trace | -n accesses]
+ */
+
+struct access
+{
+    uint64_t vpn;
+    int write;
+};
+
+static const char *policy_names[PT_POLICIES] = {"fifo", "clock", "lru", "arc"};
+
+static struct access *synthetic(size_t n, uint64_t frames)
+{
+    struct access *accesses = malloc(n * sizeof(struct access));
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t pages = frames * 4, scan = 1ULL << 32;
+    if (accesses == NULL)
+        err(1, "malloc failed");
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t r = bench_rand(&seed);
+        if (i % (frames * 16) < frames)
+        {
+            accesses[i].vpn = scan++;
+        }
+        else
+        {
+            accesses[i].vpn = (r % 10 < 8) ? (r >> 8) % (pages / 5) : (r >> 8) % pages;
+        }
+        accesses[i].write = (r >> 60) < 4;
+    }
+    return accesses;
+}
+
+static struct access *from_trace(const char *path, size_t *n)
+{
+    struct pt_trace_record record;
+    size_t capacity = 1 << 16;
+    struct access *accesses = malloc(capacity * sizeof(struct access));
+    struct pt_trace *trace = pt_trace_open(path);
+
+    *n = 0;
+    while (accesses != NULL && pt_trace_next(trace, &record))
+    {
+        if (record.op == PT_TRACE_UNMAP)
+            continue;
+
+        accesses[*n].vpn = record.vpn;
+        accesses[*n].write = (record.op == PT_TRACE_UPDATE);
+        if (++*n == capacity)
+        {
+            capacity *= 2;
+            accesses = realloc(accesses, capacity * sizeof(struct access));
+        }
+    }
+    if (accesses == NULL)
+        err(1, "malloc failed");
+    pt_trace_close(trace);
+    return accesses;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t frames = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 12;
+    size_t n = 1 << 22;
+    struct access *accesses;
+
+    if (argc > 3 && argv[2][0] == '-' && argv[2][1] == 'n')
+        n = strtoull(argv[3], NULL, 0);
+    if (argc > 2 && argv[2][0] != '-')
+        accesses = from_trace(argv[2], &n);
+    else
+        accesses = synthetic(n, frames);
+
+    printf("%zu accesses, %llu frames\n", n, (unsigned long long)frames);
+    printf("%-6s %10s %9s %11s %11s %10s %10s\n", "policy", "faults", "rate", "writebacks", "ns/access", "ns/fault",
+           "Macc/s");
+    for (int policy = 0; policy < PT_POLICIES; policy++)
+    {
+        struct pt_pager_stats stats;
+        uint64_t pt = alloc_page_frame();
+        struct pt_pager *pager = pt_pager_create(pt, frames, policy);
+
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; i++)
+        {
+            pt_pager_access(pager, accesses[i].vpn, accesses[i].write);
+        }
+        uint64_t elapsed = now_ns() - start;
+        pt_pager_get_stats(pager, &stats);
+
+        printf("%-6s %10llu %8.3f%% %11llu %11.1f %10.1f %10.2f\n", policy_names[policy],
+               (unsigned long long)stats.faults, 100.0 * stats.faults / n, (unsigned long long)stats.writebacks,
+               (double)elapsed / n, stats.faults ? (double)stats.fault_ns / stats.faults : 0.0, n * 1e3 / elapsed);
+        pt_pager_destroy(pager);
+    }
+
+    free(accesses);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Regression benchmark of the basic page table operations. For every access pattern and table size
+ * a fresh table is built with page_table_update, queried, remapped and finally torn down with
+ * unmaps, and each phase reports its throughput, latency percentiles and the frames it left in use.
+ * Every 8th operation is timed on its own for the percentiles; the timer adds a few ns to ns/op.
+ *
+ * Usage: bench_pt [max_size_log2] [pattern]
+ */
+
+#define SAMPLE_EVERY 8
+
+enum pattern
+{
+    Sequential,
+    Uniform,
+    Clustered,
+    Zipfian,
+    PATTERNS
+};
+
+static const char *pattern_names[PATTERNS] = {"sequential", "uniform", "clustered", "zipfian"};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Fills vpns with n vpns of the given pattern. Every pattern keeps the mappings about as dense
+ * as 1 in 16 pages at most, so the number of leaf nodes grows with n rather than with the span.
+ */
+static void generate(enum pattern pattern, uint64_t *vpns, uint64_t n, uint64_t *seed)
+{
+    uint64_t span_mask = n * 16 - 1;
+    uint64_t base = 0x1ULL << 32; // Away from 0, so that the upper levels aren't all index 0
+
+    switch (pattern)
+    {
+    case Sequential:
+        for (uint64_t i = 0; i < n; i++)
+        {
+            vpns[i] = base + i;
+        }
+        break;
+
+    case Uniform:
+        for (uint64_t i = 0; i < n; i++)
+        {
+            vpns[i] = base + (bench_rand(seed) & span_mask);
+        }
+        break;
+
+    case Clustered: {
+        // Runs of nearby pages that share a leaf node, with the leaves scattered over the span
+        uint64_t clusters = (n / 64) ? n / 64 : 1;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint64_t cluster = bench_rand(seed) % clusters;
+            uint64_t leaf = (cluster * 0x9E3779B97F4A7C15ULL) & span_mask & ~(uint64_t)0x1FF;
+            vpns[i] = base + leaf + (bench_rand(seed) & 63) * 8;
+        }
+        break;
+    }
+
+    case Zipfian: {
+        // Ranks drawn from Zipf(0.99) by inverting the CDF, then scattered over the span
+        double *cdf = malloc(n * sizeof(double));
+        if (cdf == NULL)
+            err(1, "malloc failed");
+
+        double sum = 0;
+        for (uint64_t r = 0; r < n; r++)
+        {
+            sum += 1.0 / pow((double)(r + 1), 0.99);
+            cdf[r] = sum;
+        }
+        for (uint64_t i = 0; i < n; i++)
+        {
+            double u = (double)(bench_rand(seed) >> 11) / (1ULL << 53) * sum;
+            uint64_t lo = 0, hi = n - 1;
+            while (lo < hi)
+            {
+                uint64_t mid = (lo + hi) / 2;
+                if (cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            vpns[i] = base + ((lo * 0x9E3779B97F4A7C15ULL) & span_mask);
+        }
+        free(cdf);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+enum op
+{
+    Map,
+    Query,
+    Remap,
+    Unmap
+};
+
+static const char *op_names[] = {"map", "query", "remap", "unmap"};
+
+/**
+ * Runs op on every vpn and prints one line of results.
+ */
+static void run_phase(enum op op, const char *pattern, uint64_t pt, const uint64_t *vpns, uint64_t n,
+                      uint64_t *samples)
+{
+    uint64_t sink = 0;
+    uint64_t sampled = 0;
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint64_t t0 = (i % SAMPLE_EVERY == 0) ? now_ns() : 0;
+
+        switch (op)
+        {
+        case Map:
+            page_table_update(pt, vpns[i], vpns[i] + 1);
+            break;
+        case Query:
+            sink += page_table_query(pt, vpns[i]);
+            break;
+        case Remap:
+            page_table_update(pt, vpns[i], vpns[i] + 2);
+            break;
+        case Unmap:
+            page_table_update(pt, vpns[i], NO_MAPPING);
+            break;
+        }
+
+        if (i % SAMPLE_EVERY == 0)
+        {
+            samples[sampled++] = now_ns() - t0;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (op == Query && sink == 0)
+        errx(1, "%s: every query missed", pattern);
+
+    qsort(samples, sampled, sizeof(uint64_t), compare_u64);
+
+    struct pt_footprint footprint;
+    pt_get_footprint(&footprint);
+    printf("%-10s %9llu %-6s %9.2f %8.1f %7llu %7llu %7llu %7llu %9llu\n", pattern, (unsigned long long)n,
+           op_names[op], n / (elapsed / 1e3), (double)elapsed / n, (unsigned long long)samples[sampled / 2],
+           (unsigned long long)samples[sampled * 90 / 100], (unsigned long long)samples[sampled * 99 / 100],
+           (unsigned long long)samples[sampled * 999 / 1000], (unsigned long long)footprint.node_frames);
+}
+
+int main(int argc, char **argv)
+{
+    int max_log2 = (argc > 1) ? atoi(argv[1]) : 20;
+    const char *only = (argc > 2) ? argv[2] : NULL;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+    printf("%-10s %9s %-6s %9s %8s %7s %7s %7s %7s %9s\n", "pattern", "size", "op", "Mops/s", "ns/op", "p50",
+           "p90", "p99", "p99.9", "frames");
+
+    for (int p = 0; p < PATTERNS; p++)
+    {
+        if (only != NULL && strcmp(only, pattern_names[p]) != 0)
+            continue;
+
+        for (int size_log2 = 12; size_log2 <= max_log2; size_log2 += 4)
+        {
+            uint64_t n = 1ULL << size_log2;
+            uint64_t *vpns = malloc(n * sizeof(uint64_t));
+            uint64_t *samples = malloc((n / SAMPLE_EVERY + 1) * sizeof(uint64_t));
+            if (vpns == NULL || samples == NULL)
+                err(1, "malloc failed");
+
+            generate(p, vpns, n, &seed);
+
+            uint64_t pt = alloc_page_frame();
+            run_phase(Map, pattern_names[p], pt, vpns, n, samples);
+            run_phase(Query, pattern_names[p], pt, vpns, n, samples);
+            run_phase(Remap, pattern_names[p], pt, vpns, n, samples);
+            run_phase(Unmap, pattern_names[p], pt, vpns, n, samples);
+            free_page_frame(pt);
+
+            free(vpns);
+            free(samples);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Replays a trace recorded with pt_trace_start against fresh tables, and reports the throughput
+ * and the counters of the translation caches. The whole trace is decoded before the clock starts.
+ * Each table of the trace gets a new table of the same kind; snapshots can't be replayed.
+ *
+ * With -g, records a synthetic trace instead: random updates, unmaps and queries over a few
+ * clusters of a single table, as the tests do.
+ *
+ * Usage: bench_replay trace [tlb_sets tlb_ways [psc_entries]]
+ *        bench_replay -g trace [operations]
+ */
+
+#define MAX_TABLES 1024
+
+struct table
+{
+    uint64_t recorded;
+    uint64_t replayed;
+};
+
+static struct table tables[MAX_TABLES];
+static int ntables;
+
+static uint64_t create_like(uint64_t recorded)
+{
+    int kind = recorded >> PT_KIND_SHIFT;
+
+    switch (kind)
+    {
+    case PT_GEOMETRY_DEFAULT:
+        return alloc_page_frame();
+    case PT_KIND_HASHED:
+        return page_table_create_hashed();
+    case PT_KIND_COMPRESSED:
+        return page_table_create_compressed();
+    default:
+        if (kind >= PT_GEOMETRIES)
+            errx(1, "table %llx of the trace can't be replayed", (unsigned long long)recorded);
+        return page_table_create(kind);
+    }
+}
+
+static uint64_t replay_table(uint64_t recorded)
+{
+    for (int i = 0; i < ntables; i++)
+    {
+        if (tables[i].recorded == recorded)
+            return tables[i].replayed;
+    }
+    if (ntables == MAX_TABLES)
+        errx(1, "the trace uses more than %d tables", MAX_TABLES);
+
+    tables[ntables] = (struct table){recorded, create_like(recorded)};
+    return tables[ntables++].replayed;
+}
+
+static void generate(const char *path, uint64_t operations)
+{
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t pt = alloc_page_frame();
+    uint64_t clusters[16];
+
+    for (int c = 0; c < 16; c++)
+    {
+        clusters[c] = bench_rand(&seed) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1) & ~0xFFFFULL;
+    }
+
+    pt_trace_start(path);
+    for (uint64_t i = 0; i < operations; i++)
+    {
+        uint64_t r = bench_rand(&seed);
+        uint64_t vpn = clusters[r % 16] + (r >> 8) % 0x10000;
+
+        switch ((r >> 40) % 8)
+        {
+        case 0:
+        case 1:
+            page_table_update(pt, vpn, r >> 44);
+            break;
+        case 2:
+            page_table_update(pt, vpn, NO_MAPPING);
+            break;
+        default:
+            page_table_query(pt, vpn);
+            break;
+        }
+    }
+    pt_trace_stop();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 && strcmp(argv[1], "-g") == 0)
+    {
+        generate(argv[2], (argc > 3) ? strtoull(argv[3], NULL, 0) : 1 << 22);
+        return 0;
+    }
+    if (argc < 2)
+        errx(1, "usage: bench_replay trace [tlb_sets tlb_ways [psc_entries]] | bench_replay -g trace [operations]");
+
+    size_t n = 0, capacity = 1 << 16;
+    struct pt_trace_record *records = malloc(capacity * sizeof(struct pt_trace_record));
+    struct pt_trace *trace = pt_trace_open(argv[1]);
+    while (records != NULL && pt_trace_next(trace, &records[n]))
+    {
+        if (++n == capacity)
+        {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(struct pt_trace_record));
+        }
+    }
+    if (records == NULL)
+        err(1, "malloc failed");
+    pt_trace_close(trace);
+
+    // Resolve the tables up front as well
+    for (size_t i = 0; i < n; i++)
+    {
+        records[i].pt = replay_table(records[i].pt);
+    }
+
+    if (argc > 3)
+        pt_tlb_enable(strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0));
+    if (argc > 4)
+        pt_psc_enable(strtoul(argv[4], NULL, 0));
+
+    uint64_t queries = 0, mapped = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (records[i].op == PT_TRACE_QUERY)
+        {
+            queries++;
+            mapped += (page_table_query(records[i].pt, records[i].vpn) != NO_MAPPING);
+        }
+        else
+        {
+            page_table_update(records[i].pt, records[i].vpn, records[i].ppn);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    struct pt_tlb_stats tlb;
+    struct pt_psc_stats psc;
+    struct pt_footprint footprint;
+    pt_tlb_get_stats(&tlb);
+    pt_psc_get_stats(&psc);
+    pt_get_footprint(&footprint);
+
+    printf("operations %zu (%llu queries, %llu mapped) on %d tables\n", n, (unsigned long long)queries,
+           (unsigned long long)mapped, ntables);
+    printf("time       %.3f ms, %.1f ns/op, %.2f Mops/s\n", elapsed / 1e6, (double)elapsed / n, n * 1e3 / elapsed);
+    printf("tlb        %llu hits, %llu misses, %llu evictions, %llu invalidations\n", (unsigned long long)tlb.hits,
+           (unsigned long long)tlb.misses, (unsigned long long)tlb.evictions, (unsigned long long)tlb.invalidations);
+    printf("psc        %llu misses, %llu invalidations, hits per level", (unsigned long long)psc.misses,
+           (unsigned long long)psc.invalidations);
+    for (int level = 1; level < PT_LEVELS; level++)
+    {
+        printf(" %llu", (unsigned long long)psc.hits[level]);
+    }
+    printf("\nnodes      %llu frames\n", (unsigned long long)footprint.node_frames);
+
+    free(records);
+    return 0;
+}
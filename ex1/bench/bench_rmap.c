@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Measures what the reverse map adds to the update path: the same random mappings are made,
+ * remapped and unmapped with the map disabled and enabled. Then times finding every mapping of
+ * a frame that is shared by a growing number of vpns.
+ *
+ * Usage: bench_rmap [mappings] [span_bits]
+ */
+
+static uint64_t mapped;
+
+static int count_mapping(uint64_t pt, uint64_t vpn, void *arg)
+{
+    mapped++;
+    return 0;
+}
+
+/**
+ * Maps, remaps and unmaps the same vpns, printing the ns/op of each phase (unless name is NULL).
+ */
+static void run(const char *name, uint64_t mappings, uint64_t span_mask)
+{
+    uint64_t pt = alloc_page_frame();
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t times[3];
+
+    for (int phase = 0; phase < 3; phase++)
+    {
+        seed = 0x9E3779B97F4A7C15ULL;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < mappings; i++)
+        {
+            uint64_t vpn = bench_rand(&seed) & span_mask;
+            page_table_update(pt, vpn, (phase == 2) ? NO_MAPPING : (vpn >> phase) & 0xFFFFFF);
+        }
+        times[phase] = now_ns() - start;
+    }
+    if (name == NULL)
+        return;
+    printf("%-10s %10.1f %10.1f %10.1f\n", name, (double)times[0] / mappings, (double)times[1] / mappings,
+           (double)times[2] / mappings);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 20;
+    int span_bits = (argc > 2) ? atoi(argv[2]) : 24;
+    uint64_t span_mask = (1ULL << span_bits) - 1;
+
+    printf("%-10s %10s %10s %10s  (ns/update)\n", "rmap", "map", "remap", "unmap");
+    run(NULL, mappings, span_mask); // Warm up, so that neither run pays for mmap-ing the node frames
+    run("disabled", mappings, span_mask);
+    pt_rmap_enable();
+    run("enabled", mappings, span_mask);
+
+    // A frame shared by more and more vpns, next to a million unrelated mappings
+    uint64_t pt = alloc_page_frame();
+    page_table_update_range(pt, 1ULL << 30, 1ULL << 24, mappings);
+    printf("\n%10s %14s %14s\n", "sharers", "ns/lookup", "ns/sharer");
+    for (uint64_t sharers = 1, done = 0; sharers <= 4096; sharers *= 4)
+    {
+        for (; done < sharers; done++)
+        {
+            page_table_update(pt, done * 7, 0x42);
+        }
+
+        int rounds = 1000;
+        mapped = 0;
+        uint64_t start = now_ns();
+        for (int r = 0; r < rounds; r++)
+        {
+            pt_rmap_for_each(0x42, count_mapping, NULL);
+        }
+        double ns = (double)(now_ns() - start) / rounds;
+        if (mapped != sharers * rounds)
+            errx(1, "found %llu mappings of the frame instead of %llu", (unsigned long long)(mapped / rounds),
+                 (unsigned long long)sharers);
+        printf("%10llu %14.1f %14.2f\n", (unsigned long long)sharers, ns, ns / sharers);
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Maps the same number of pages as one dense run, as runs of 64 pages scattered over the address
+ * space and as single pages scattered over it, and prints the shape of each table: nodes and fill
+ * factor per level, node memory per mapping and the longest single-entry chain. Sparse levels and
+ * long chains are where a compressed table pays; full leaf nodes are where huge pages would.
+ * The tables are measured in slices of 256 nodes, whose average time is reported too.
+ *
+ * Usage: bench_shape [pages]
+ */
+
+#define SLICE 256
+
+static void print_shape(const char *name, uint64_t pt)
+{
+    struct pt_shape_walk walk;
+    uint64_t slices = 1;
+
+    pt_shape_init(&walk, pt);
+    uint64_t start = now_ns();
+    while (!page_table_shape(&walk, SLICE))
+    {
+        slices++;
+    }
+    uint64_t elapsed = now_ns() - start;
+    struct pt_shape *shape = &walk.shape;
+
+    printf("%s\n", name);
+    for (int level = 0; level < PT_LEVELS; level++)
+    {
+        printf("  level %d %10llu nodes %7.2f%% full\n", level, (unsigned long long)shape->nodes[level],
+               shape->nodes[level] ? 100.0 * shape->entries[level] / (shape->nodes[level] << SYMBOL_BITS) : 0.0);
+    }
+    printf("  %llu frames for %llu mappings (%.1f bytes each), longest chain %llu, %.1f us per slice\n",
+           (unsigned long long)shape->frames, (unsigned long long)shape->mappings,
+           (double)(shape->frames * 4096) / shape->mappings, (unsigned long long)shape->longest_chain,
+           elapsed / 1000.0 / slices);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t pages = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 18;
+    uint64_t vpn_mask = (1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1;
+    uint64_t dense = page_table_create(PT_GEOMETRY_DEFAULT);
+    uint64_t clustered = page_table_create(PT_GEOMETRY_DEFAULT);
+    uint64_t scattered = page_table_create(PT_GEOMETRY_DEFAULT);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t run = 0;
+
+    page_table_update_range(dense, 0x100000, 0, pages);
+    for (uint64_t p = 0; p < pages; p++)
+    {
+        run = (p % 64) ? run + 1 : bench_rand(&seed) & vpn_mask & ~63ULL;
+        page_table_update(clustered, run, p);
+        page_table_update(scattered, bench_rand(&seed) & vpn_mask, p);
+    }
+
+    printf("%llu pages each\n", (unsigned long long)pages);
+    print_shape("dense", dense);
+    print_shape("runs of 64", clustered);
+    print_shape("scattered", scattered);
+    return 0;
+}
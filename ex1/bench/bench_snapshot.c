@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Compares rebuilding a table by replaying its updates with saving it once and loading the
+ * snapshot back, then checks the snapshot against the table with random lookups.
+ *
+ * Usage: bench_snapshot [mappings] [path]
+ */
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 20;
+    const char *path = (argc > 2) ? argv[2] : "/tmp/bench_snapshot.pt";
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t pt = alloc_page_frame();
+
+    // Clusters of 256 pages at random spots
+    uint64_t start = now_ns();
+    uint64_t base = 0;
+    for (uint64_t i = 0; i < mappings; i++)
+    {
+        if (i % 256 == 0)
+            base = bench_rand(&seed) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1) & ~0xFFULL;
+        page_table_update(pt, base + i % 256, i);
+    }
+    uint64_t replay = now_ns() - start;
+
+    start = now_ns();
+    page_table_save(pt, path);
+    uint64_t save = now_ns() - start;
+
+    start = now_ns();
+    uint64_t snapshot = page_table_load(path);
+    uint64_t load = now_ns() - start;
+
+    seed = 0x9E3779B97F4A7C15ULL;
+    start = now_ns();
+    for (uint64_t i = 0; i < mappings; i++)
+    {
+        if (i % 256 == 0)
+            base = bench_rand(&seed) & ((1ULL << (SYMBOL_BITS * PT_LEVELS)) - 1) & ~0xFFULL;
+        if (page_table_query(snapshot, base + i % 256) != page_table_query(pt, base + i % 256))
+            errx(1, "snapshot disagrees on vpn %llx", (unsigned long long)(base + i % 256));
+    }
+    uint64_t check = now_ns() - start;
+
+    printf("mappings   %llu\n", (unsigned long long)mappings);
+    printf("replay     %10.3f ms\n", replay / 1e6);
+    printf("save       %10.3f ms\n", save / 1e6);
+    printf("load       %10.3f ms\n", load / 1e6);
+    printf("check      %10.1f ns/query (both tables, cold snapshot)\n", (double)check / mappings);
+
+    page_table_unload(snapshot);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pt.h"
+#include "bench.h"
+
+/*
+ * Compares the scalar page_walk loop against the interleaved (prefetching) batch walker.
+ * The mappings are spread over a span wide enough that the leaf level of the table is much
+ * larger than the LLC, so every lookup is a chain of dependent cache misses.
+ *
+ * Usage: bench_walk [mappings] [span_bits] [lookups]
+ */
+
+int main(int argc, char **argv)
+{
+    uint64_t mappings = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1 << 19;
+    int span_bits = (argc > 2) ? atoi(argv[2]) : 26;
+    size_t lookups = (argc > 3) ? strtoull(argv[3], NULL, 0) : 1 << 22;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t span_mask = (1ULL << span_bits) - 1;
+
+    uint64_t pt = alloc_page_frame();
+    uint64_t *vpns = malloc(lookups * sizeof(uint64_t));
+    uint64_t *expected = malloc(lookups * sizeof(uint64_t));
+    uint64_t *ppns = malloc(lookups * sizeof(uint64_t));
+    if (vpns == NULL || expected == NULL || ppns == NULL)
+        err(1, "malloc failed");
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < mappings; i++)
+    {
+        uint64_t vpn = bench_rand(&seed) & span_mask;
+        page_table_update(pt, vpn, vpn + 1);
+    }
+    printf("built %llu mappings over 2^%d vpns in %.1f ms\n", (unsigned long long)mappings, span_bits,
+           (now_ns() - start) / 1e6);
+
+    for (size_t i = 0; i < lookups; i++)
+    {
+        vpns[i] = bench_rand(&seed) & span_mask;
+    }
+
+    start = now_ns();
+    for (size_t i = 0; i < lookups; i++)
+    {
+        expected[i] = page_table_query(pt, vpns[i]);
+    }
+    printf("%-16s %8.2f ns/lookup\n", "scalar", (double)(now_ns() - start) / lookups);
+
+    start = now_ns();
+    page_table_query_batch(pt, vpns, ppns, lookups);
+    printf("%-16s %8.2f ns/lookup\n", "batch", (double)(now_ns() - start) / lookups);
+
+    for (unsigned int inflight = 1; inflight <= PT_MAX_INFLIGHT; inflight *= 2)
+    {
+        start = now_ns();
+        page_table_query_interleaved(pt, vpns, ppns, lookups, inflight);
+        uint64_t elapsed = now_ns() - start;
+
+        for (size_t i = 0; i < lookups; i++)
+        {
+            if (ppns[i] != expected[i])
+                errx(1, "interleaved walk disagrees with page_table_query on vpn %llx",
+                     (unsigned long long)vpns[i]);
+        }
+        printf("interleaved(%2u)  %8.2f ns/lookup\n", inflight, (double)elapsed / lookups);
+    }
+
+    free(vpns);
+    free(expected);
+    free(ppns);
+    return 0;
+}
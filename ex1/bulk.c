@@ -0,0 +1,163 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+/*
+ * The pairs under one root entry form a run of the sorted array, and the subtree of each run is
+ * built by one thread, which never touches a node of another run. The nodes on the path of the
+ * previous pair are kept at hand, so each pair only allocates the nodes where its vpn leaves that
+ * path and stores its leaf, and no walk ever starts from the root. The root itself is only written
+ * once every thread is done, by the caller.
+ */
+
+#define ROOT_ENTRIES (1 << SYMBOL_BITS)
+
+struct bulk_job
+{
+    const struct pt_pair *pairs;
+    const size_t *starts;   // starts[t] is the first pair under root entry t, starts[ROOT_ENTRIES] = n
+    int first;              // Root entries [first, last) are this job's
+    int last;
+    uint64_t *subtrees;     // The job stores the level-1 node of every entry it built here
+};
+
+/**
+ * Builds the subtree of the pairs [lo, hi), which all fall under one root entry, and returns
+ * the frame of its level-1 node.
+ */
+static uint64_t build_subtree(const struct pt_pair *pairs, size_t lo, size_t hi)
+{
+    uint64_t frames[PT_LEVELS];
+    uint64_t prefixes[PT_LEVELS];
+    int depth = 2; // Levels [1, depth) of the path are those of the previous pair
+
+    frames[1] = alloc_node();
+    prefixes[1] = get_prefix(pairs[lo].vpn, 1);
+
+    for (size_t i = lo; i < hi; i++)
+    {
+        uint64_t vpn = pairs[i].vpn;
+
+        while (depth > 2 && get_prefix(vpn, depth - 1) != prefixes[depth - 1])
+        {
+            depth--;
+        }
+        for (; depth < PT_LEVELS; depth++)
+        {
+            uint64_t *parent = (uint64_t *)phys_to_virt(frames[depth - 1] << OFFSET_BITS);
+            frames[depth] = alloc_node();
+            prefixes[depth] = get_prefix(vpn, depth);
+            store_pte(frames[depth - 1], parent, get_index(vpn, depth - 1), create_pte(frames[depth]));
+        }
+
+        uint64_t *leaf = (uint64_t *)phys_to_virt(frames[PT_LEVELS - 1] << OFFSET_BITS);
+        store_pte(frames[PT_LEVELS - 1], leaf, get_index(vpn, PT_LEVELS - 1), create_pte(pairs[i].ppn));
+    }
+    return frames[1];
+}
+
+static void *run_job(void *arg)
+{
+    struct bulk_job *job = arg;
+
+    for (int t = job->first; t < job->last; t++)
+    {
+        if (job->starts[t] < job->starts[t + 1] && job->subtrees[t] != NO_MAPPING)
+        {
+            job->subtrees[t] = build_subtree(job->pairs, job->starts[t], job->starts[t + 1]);
+        }
+    }
+    return NULL;
+}
+
+void page_table_bulk_load(uint64_t pt, const struct pt_pair *pairs, size_t n, unsigned int nthreads)
+{
+    size_t starts[ROOT_ENTRIES + 1];
+    uint64_t subtrees[ROOT_ENTRIES];
+    uint64_t *root = (uint64_t *)phys_to_virt(table_root(pt) << OFFSET_BITS);
+
+    if (table_kind(pt) != PT_GEOMETRY_DEFAULT)
+        errx(1, "page_table_bulk_load: only tables of the default geometry are supported");
+    for (size_t i = 0; i < n; i++)
+    {
+        if (pairs[i].vpn >> (PT_LEVELS * SYMBOL_BITS) != 0 || pairs[i].ppn == NO_MAPPING)
+            errx(1, "page_table_bulk_load: can't map vpn %llx to ppn %llx", (unsigned long long)pairs[i].vpn,
+                 (unsigned long long)pairs[i].ppn);
+        if (i > 0 && pairs[i].vpn < pairs[i - 1].vpn)
+            errx(1, "page_table_bulk_load: the pairs aren't sorted by vpn");
+    }
+
+    // The reverse map, the trace and concurrent readers all expect one update at a time
+    if (rmap_enabled || trace_enabled || pt_concurrent || nthreads == 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            page_table_update(pt, pairs[i].vpn, pairs[i].ppn);
+        }
+        return;
+    }
+
+    // Runs of the root entries that already hold something go through page_table_update instead,
+    // which merges them into the existing subtrees (and copies shared ones)
+    for (int t = 0, i = 0; t <= ROOT_ENTRIES; t++)
+    {
+        while ((size_t)i < n && get_index(pairs[i].vpn, 0) < t)
+        {
+            i++;
+        }
+        starts[t] = i;
+        if (t < ROOT_ENTRIES)
+        {
+            subtrees[t] = is_valid_pte(load_pte(&root[t])) ? NO_MAPPING : 0;
+        }
+    }
+
+    // Contiguous root entries per thread, about n / nthreads pairs each
+    if (nthreads > ROOT_ENTRIES)
+    {
+        nthreads = ROOT_ENTRIES;
+    }
+    struct bulk_job jobs[nthreads];
+    pthread_t threads[nthreads];
+    int t = 0;
+    for (unsigned int j = 0; j < nthreads; j++)
+    {
+        size_t goal = n * (j + 1) / nthreads;
+        jobs[j] = (struct bulk_job){pairs, starts, t, t, subtrees};
+        while (t < ROOT_ENTRIES && (starts[t] < goal || j == nthreads - 1))
+        {
+            t++;
+        }
+        jobs[j].last = t;
+    }
+
+    for (unsigned int j = 1; j < nthreads; j++)
+    {
+        if (pthread_create(&threads[j], NULL, run_job, &jobs[j]) != 0)
+            errx(1, "page_table_bulk_load: pthread_create failed");
+    }
+    run_job(&jobs[0]);
+    for (unsigned int j = 1; j < nthreads; j++)
+    {
+        pthread_join(threads[j], NULL);
+    }
+
+    for (t = 0; t < ROOT_ENTRIES; t++)
+    {
+        if (starts[t] == starts[t + 1])
+        {
+            continue;
+        }
+        if (subtrees[t] != NO_MAPPING)
+        {
+            store_pte(table_root(pt), root, t, create_pte(subtrees[t]));
+            continue;
+        }
+        for (size_t i = starts[t]; i < starts[t + 1]; i++)
+        {
+            page_table_update(pt, pairs[i].vpn, pairs[i].ppn);
+        }
+    }
+}
@@ -0,0 +1,432 @@
+#include <err.h>
+#include <string.h>
+
+#include "pt_internal.h"
+
+/*
+ * A compressed table has the levels of the default radix tree, with two node forms: full nodes
+ * (a frame of 1 << SYMBOL_BITS entries, like the default tree) and sparse nodes (a 128-byte chunk
+ * holding up to SPARSE_SLOTS entries, sorted by index). The root is always a full node.
+ *
+ * A parent entry doesn't have to point at the next level: it points at the node of any deeper level,
+ * and the levels in between, which would each have a single child, are skipped. Every node knows the
+ * prefix of the vpns below it (in its header when sparse, in its node_meta when full), so a walk
+ * that arrives through a skipping entry checks the skipped symbols there.
+ *
+ * A pointer pte carries the form and the level of the node it points at in its flag bits, and for
+ * a sparse node the chunk within the frame. Leaf ptes are the same as in the default tree.
+ */
+
+#define SPARSE_SLOTS 11
+#define SPARSE_BYTES 128
+#define SPARSE_CHUNKS ((1 << OFFSET_BITS) / SPARSE_BYTES)
+#define SHRINK_ENTRIES 4 // A full node that gets down to this many entries becomes sparse again
+
+#define SPARSE_MASK 0x4ULL
+#define LEVEL_SHIFT 3
+#define LEVEL_MASK 0x7ULL
+#define CHUNK_SHIFT 7
+
+#define VPN_MASK ((1ULL << (PT_LEVELS * SYMBOL_BITS)) - 1)
+
+struct sparse_node
+{
+    uint64_t prefix;                  // get_prefix() of the vpns below the node
+    uint8_t level;
+    uint8_t count;
+    uint16_t indices[SPARSE_SLOTS];   // Sorted
+    uint64_t ptes[SPARSE_SLOTS];      // ptes[s] is the entry of index indices[s]
+};
+
+_Static_assert(sizeof(struct sparse_node) <= SPARSE_BYTES, "a sparse node must fit its chunk");
+
+// ----------------------------------- Node refs -----------------------------------
+
+static inline int ref_level(uint64_t ref)
+{
+    return (ref >> LEVEL_SHIFT) & LEVEL_MASK;
+}
+
+static inline int ref_sparse(uint64_t ref)
+{
+    return (ref & SPARSE_MASK) != 0;
+}
+
+static inline uint64_t *full_node(uint64_t ref)
+{
+    return (uint64_t *)phys_to_virt(get_frame_number(ref) << OFFSET_BITS);
+}
+
+static inline struct sparse_node *sparse_node(uint64_t ref)
+{
+    char *frame = phys_to_virt(get_frame_number(ref) << OFFSET_BITS);
+    return (struct sparse_node *)(frame + ((ref >> CHUNK_SHIFT) % SPARSE_CHUNKS) * SPARSE_BYTES);
+}
+
+static uint64_t full_ref(uint64_t frame, int level)
+{
+    return create_pte(frame) | ((uint64_t)level << LEVEL_SHIFT);
+}
+
+static uint64_t ref_prefix(uint64_t ref)
+{
+    return ref_sparse(ref) ? sparse_node(ref)->prefix : node_meta(get_frame_number(ref))->prefix;
+}
+
+static int ref_count(uint64_t ref)
+{
+    return ref_sparse(ref) ? sparse_node(ref)->count : node_meta(get_frame_number(ref))->live;
+}
+
+// --------------------------------- Sparse chunks ---------------------------------
+
+// Free chunks, linked through their first word as chunk ids (frame * SPARSE_CHUNKS + chunk).
+// Chunk frames are kept for reuse once carved, and count as node frames.
+static uint64_t chunk_head = NO_MAPPING;
+
+static uint64_t alloc_sparse(int level, uint64_t prefix)
+{
+    if (chunk_head == NO_MAPPING)
+    {
+        uint64_t frame = alloc_node();
+        uint64_t *words = phys_to_virt(frame << OFFSET_BITS);
+
+        for (int c = SPARSE_CHUNKS - 1; c >= 0; c--)
+        {
+            words[c * SPARSE_BYTES / sizeof(uint64_t)] = chunk_head;
+            chunk_head = frame * SPARSE_CHUNKS + c;
+        }
+    }
+
+    uint64_t id = chunk_head;
+    uint64_t ref = create_pte(id / SPARSE_CHUNKS) | ((id % SPARSE_CHUNKS) << CHUNK_SHIFT) | SPARSE_MASK |
+                   ((uint64_t)level << LEVEL_SHIFT);
+    struct sparse_node *node = sparse_node(ref);
+
+    chunk_head = *(uint64_t *)node;
+    memset(node, 0, sizeof(*node));
+    node->prefix = prefix;
+    node->level = level;
+    return ref;
+}
+
+static void free_sparse(uint64_t ref)
+{
+    *(uint64_t *)sparse_node(ref) = chunk_head;
+    chunk_head = get_frame_number(ref) * SPARSE_CHUNKS + ((ref >> CHUNK_SHIFT) % SPARSE_CHUNKS);
+}
+
+static uint64_t alloc_full(int level, uint64_t prefix)
+{
+    uint64_t frame = alloc_node();
+
+    node_meta(frame)->prefix = prefix;
+    return full_ref(frame, level);
+}
+
+// ------------------------------------ Entries ------------------------------------
+
+/**
+ * Returns a pointer to the entry of the node for index, or NULL if a sparse node has none.
+ * The entry of a full node may be invalid.
+ */
+static uint64_t *node_entry(uint64_t ref, int index)
+{
+    if (!ref_sparse(ref))
+    {
+        return &full_node(ref)[index];
+    }
+
+    struct sparse_node *node = sparse_node(ref);
+    for (int s = 0; s < node->count && node->indices[s] <= index; s++)
+    {
+        if (node->indices[s] == index)
+        {
+            return &node->ptes[s];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copies the entries of a sparse node into a new full node, frees it and returns the full one.
+ */
+static uint64_t expand(uint64_t ref)
+{
+    struct sparse_node *node = sparse_node(ref);
+    uint64_t full = alloc_full(node->level, node->prefix);
+    uint64_t frame = get_frame_number(full);
+
+    for (int s = 0; s < node->count; s++)
+    {
+        store_pte(frame, full_node(full), node->indices[s], node->ptes[s]);
+    }
+    free_sparse(ref);
+    return full;
+}
+
+/**
+ * Copies the few entries left in a full node into a new sparse node, frees it and returns the sparse one.
+ */
+static uint64_t shrink(uint64_t ref)
+{
+    uint64_t frame = get_frame_number(ref);
+    uint64_t *entries = full_node(ref);
+    struct node_meta *meta = node_meta(frame);
+    uint64_t sparse = alloc_sparse(ref_level(ref), meta->prefix);
+    struct sparse_node *node = sparse_node(sparse);
+
+    for (int w = 0; w < OCCUPANCY_WORDS; w++)
+    {
+        for (uint64_t bits = meta->occupancy[w]; bits != 0; bits &= bits - 1)
+        {
+            int index = w * 64 + __builtin_ctzll(bits);
+            node->indices[node->count] = index;
+            node->ptes[node->count++] = entries[index];
+        }
+    }
+    free_node(frame);
+    return sparse;
+}
+
+/**
+ * Adds an entry for an index the node has none for. A sparse node with no room left is expanded
+ * first, and *link (the parent entry pointing at it) updated.
+ */
+static void insert_entry(uint64_t ref, uint64_t *link, int index, uint64_t pte)
+{
+    if (ref_sparse(ref) && sparse_node(ref)->count == SPARSE_SLOTS)
+    {
+        ref = expand(ref);
+        *link = ref;
+    }
+    if (!ref_sparse(ref))
+    {
+        store_pte(get_frame_number(ref), full_node(ref), index, pte);
+        return;
+    }
+
+    struct sparse_node *node = sparse_node(ref);
+    int s = node->count;
+    for (; s > 0 && node->indices[s - 1] > index; s--)
+    {
+        node->indices[s] = node->indices[s - 1];
+        node->ptes[s] = node->ptes[s - 1];
+    }
+    node->indices[s] = index;
+    node->ptes[s] = pte;
+    node->count++;
+}
+
+static void remove_entry(uint64_t ref, int index)
+{
+    if (!ref_sparse(ref))
+    {
+        store_pte(get_frame_number(ref), full_node(ref), index, 0);
+        return;
+    }
+
+    struct sparse_node *node = sparse_node(ref);
+    int s = 0;
+    while (node->indices[s] != index)
+    {
+        s++;
+    }
+    node->count--;
+    memmove(&node->indices[s], &node->indices[s + 1], (node->count - s) * sizeof(node->indices[0]));
+    memmove(&node->ptes[s], &node->ptes[s + 1], (node->count - s) * sizeof(node->ptes[0]));
+}
+
+/**
+ * Returns the entry of a node that has exactly one.
+ */
+static uint64_t *only_entry(uint64_t ref)
+{
+    if (ref_sparse(ref))
+    {
+        return &sparse_node(ref)->ptes[0];
+    }
+
+    uint64_t *words = node_meta(get_frame_number(ref))->occupancy;
+    int w = 0;
+    while (words[w] == 0)
+    {
+        w++;
+    }
+    return &full_node(ref)[w * 64 + __builtin_ctzll(words[w])];
+}
+
+static void free_ref(uint64_t ref)
+{
+    if (ref_sparse(ref))
+    {
+        free_sparse(ref);
+    }
+    else
+    {
+        free_node(get_frame_number(ref));
+    }
+}
+
+// ------------------------------------- Walks -------------------------------------
+
+uint64_t page_table_create_compressed(void)
+{
+    return alloc_page_frame() | ((uint64_t)PT_KIND_COMPRESSED << PT_KIND_SHIFT);
+}
+
+uint64_t compressed_query(uint64_t pt, uint64_t vpn)
+{
+    uint64_t ref = full_ref(table_root(pt), 0);
+    int parent_level = -1;
+
+    vpn &= VPN_MASK;
+    for (;;)
+    {
+        int level = ref_level(ref);
+        if (level > parent_level + 1 && get_prefix(vpn, level) != ref_prefix(ref))
+        {
+            return NO_MAPPING;
+        }
+
+        uint64_t *pte = node_entry(ref, get_index(vpn, level));
+        if (pte == NULL || !is_valid_pte(*pte))
+        {
+            return NO_MAPPING;
+        }
+        if (level == PT_LEVELS - 1)
+        {
+            return get_frame_number(*pte);
+        }
+        parent_level = level;
+        ref = *pte;
+    }
+}
+
+static void compressed_map(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    uint64_t ref = full_ref(table_root(pt), 0);
+    uint64_t *link = NULL; // The parent entry pointing at ref
+    int parent_level = -1;
+
+    for (;;)
+    {
+        int level = ref_level(ref);
+        uint64_t prefix = (level > parent_level + 1) ? ref_prefix(ref) : 0;
+
+        if (level > parent_level + 1 && get_prefix(vpn, level) != prefix)
+        {
+            // vpn leaves the skipped path: a new node at the deepest level they share splits the edge
+            int split = level - 1;
+            while (get_prefix(vpn, split) != prefix >> (SYMBOL_BITS * (level - split)))
+            {
+                split--;
+            }
+            uint64_t node = alloc_sparse(split, get_prefix(vpn, split));
+            insert_entry(node, NULL, (prefix >> (SYMBOL_BITS * (level - split - 1))) & SYMBOL_MASK, ref);
+            *link = node;
+            ref = node;
+            continue;
+        }
+
+        int index = get_index(vpn, level);
+        uint64_t *pte = node_entry(ref, index);
+        if (pte != NULL && is_valid_pte(*pte))
+        {
+            if (level == PT_LEVELS - 1)
+            {
+                *pte = create_pte(ppn);
+                return;
+            }
+            link = pte;
+            parent_level = level;
+            ref = *pte;
+            continue;
+        }
+
+        if (level == PT_LEVELS - 1)
+        {
+            insert_entry(ref, link, index, create_pte(ppn));
+            return;
+        }
+
+        // Nothing below: the leaf goes into a sparse node of the last level, skipping those in between
+        uint64_t leaf = alloc_sparse(PT_LEVELS - 1, get_prefix(vpn, PT_LEVELS - 1));
+        insert_entry(leaf, NULL, get_index(vpn, PT_LEVELS - 1), create_pte(ppn));
+        insert_entry(ref, link, index, leaf);
+        return;
+    }
+}
+
+static void compressed_unmap(uint64_t pt, uint64_t vpn)
+{
+    uint64_t refs[PT_LEVELS];
+    uint64_t *links[PT_LEVELS];
+    int depth = 0;
+
+    refs[0] = full_ref(table_root(pt), 0);
+    links[0] = NULL;
+    for (int parent_level = -1;;)
+    {
+        uint64_t ref = refs[depth];
+        int level = ref_level(ref);
+        if (level > parent_level + 1 && get_prefix(vpn, level) != ref_prefix(ref))
+        {
+            return;
+        }
+
+        uint64_t *pte = node_entry(ref, get_index(vpn, level));
+        if (pte == NULL || !is_valid_pte(*pte))
+        {
+            return;
+        }
+        if (level == PT_LEVELS - 1)
+        {
+            remove_entry(ref, get_index(vpn, level));
+            break;
+        }
+        parent_level = level;
+        refs[++depth] = *pte;
+        links[depth] = pte;
+    }
+
+    // Empty nodes go away, an interior node left with one child hands it to its parent entry,
+    // and a full node left with a few entries becomes sparse. The root stays as it is.
+    for (; depth > 0; depth--)
+    {
+        uint64_t ref = refs[depth];
+        int count = ref_count(ref);
+
+        if (count == 0)
+        {
+            free_ref(ref);
+            remove_entry(refs[depth - 1], get_index(vpn, ref_level(refs[depth - 1])));
+            continue;
+        }
+        if (count == 1 && ref_level(ref) < PT_LEVELS - 1)
+        {
+            *links[depth] = *only_entry(ref);
+            free_ref(ref);
+        }
+        else if (!ref_sparse(ref) && count <= SHRINK_ENTRIES)
+        {
+            *links[depth] = shrink(ref);
+        }
+        break;
+    }
+}
+
+void compressed_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    if (pt_concurrent)
+        errx(1, "compressed tables can't be updated in concurrent mode");
+
+    if (ppn == NO_MAPPING)
+    {
+        compressed_unmap(pt, vpn & VPN_MASK);
+    }
+    else
+    {
+        compressed_map(pt, vpn & VPN_MASK, ppn);
+    }
+}
@@ -0,0 +1,193 @@
+#include <err.h>
+
+#include "pt_internal.h"
+
+/*
+ * Every geometry gets its own query, map and unmap functions. They are all stamped out of the
+ * generic walks below with constant parameters, so that the compiler unrolls the levels and each
+ * operation runs a straight sequence of loads without mode or geometry checks.
+ */
+
+#define WALK static inline __attribute__((always_inline))
+
+/**
+ * Number of 4 KiB frames a node of 2^bits entries takes.
+ */
+WALK unsigned int node_frames(const int bits)
+{
+    return (bits + 3 > OFFSET_BITS) ? 1U << (bits + 3 - OFFSET_BITS) : 1;
+}
+
+WALK uint64_t *geo_node(uint64_t frame)
+{
+    return (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+}
+
+WALK int geo_index(uint64_t vpn, int level, const int levels, const int bits)
+{
+    return (vpn >> (bits * (levels - 1 - level))) & ((1ULL << bits) - 1);
+}
+
+WALK uint64_t geo_query(uint64_t root, uint64_t vpn, const int levels, const int bits, const int top_bits)
+{
+    uint64_t frame = root;
+    uint64_t pte;
+
+    if (vpn >> (top_bits + bits * (levels - 1)))
+    {
+        return NO_MAPPING;
+    }
+
+#pragma GCC unroll 8
+    for (int i = 0; i < levels - 1; i++)
+    {
+        pte = load_pte(&geo_node(frame)[geo_index(vpn, i, levels, bits)]);
+        if (!is_valid_pte(pte))
+        {
+            return NO_MAPPING;
+        }
+        frame = get_frame_number(pte);
+    }
+
+    pte = load_pte(&geo_node(frame)[geo_index(vpn, levels - 1, levels, bits)]);
+    return is_valid_pte(pte) ? get_frame_number(pte) : NO_MAPPING;
+}
+
+WALK void geo_map(uint64_t root, uint64_t vpn, uint64_t ppn, const int levels, const int bits, const int top_bits)
+{
+    uint64_t frame = root;
+
+    if (vpn >> (top_bits + bits * (levels - 1)))
+        errx(1, "vpn %llx doesn't fit into the table's geometry", (unsigned long long)vpn);
+
+#pragma GCC unroll 8
+    for (int i = 0; i < levels - 1; i++)
+    {
+        uint64_t *node = geo_node(frame);
+        int index = geo_index(vpn, i, levels, bits);
+        uint64_t pte = load_pte(&node[index]);
+
+        while (!is_valid_pte(pte))
+        {
+            uint64_t child = alloc_wide_node(node_frames(bits));
+            if (install_pte(frame, node, index, pte, create_pte(child)))
+            {
+                pte = create_pte(child);
+                break;
+            }
+
+            // Another thread has changed the entry first, give the node back and look at it again
+            free_wide_node(child, node_frames(bits));
+            pte = load_pte(&node[index]);
+        }
+        frame = get_frame_number(pte);
+    }
+
+    store_pte(frame, geo_node(frame), geo_index(vpn, levels - 1, levels, bits), create_pte(ppn));
+}
+
+WALK void geo_unmap(uint64_t root, uint64_t vpn, const int levels, const int bits, const int top_bits)
+{
+    uint64_t path[levels]; // path[i] = frame of the node at level i
+    int i;
+
+    if (vpn >> (top_bits + bits * (levels - 1)))
+    {
+        return;
+    }
+
+    path[0] = root;
+#pragma GCC unroll 8
+    for (i = 0; i < levels - 1; i++)
+    {
+        uint64_t pte = load_pte(&geo_node(path[i])[geo_index(vpn, i, levels, bits)]);
+        if (!is_valid_pte(pte))
+        {
+            return;
+        }
+        path[i + 1] = get_frame_number(pte);
+    }
+
+    store_pte(path[levels - 1], geo_node(path[levels - 1]), geo_index(vpn, levels - 1, levels, bits), 0ULL);
+
+    // Free the nodes that became empty, as reclaim_path does for the default geometry
+    for (i = levels - 1; i > 0 && !pt_concurrent && node_meta(path[i])->live == 0; i--)
+    {
+        free_wide_node(path[i], node_frames(bits));
+        store_pte(path[i - 1], geo_node(path[i - 1]), geo_index(vpn, i - 1, levels, bits), 0ULL);
+    }
+}
+
+#define DEFINE_GEOMETRY(name, levels, bits, top_bits)                                                             \
+    static uint64_t name##_query(uint64_t root, uint64_t vpn)                                                     \
+    {                                                                                                             \
+        return geo_query(root, vpn, levels, bits, top_bits);                                                      \
+    }                                                                                                             \
+    static void name##_map(uint64_t root, uint64_t vpn, uint64_t ppn)                                             \
+    {                                                                                                             \
+        geo_map(root, vpn, ppn, levels, bits, top_bits);                                                          \
+    }                                                                                                             \
+    static void name##_unmap(uint64_t root, uint64_t vpn)                                                         \
+    {                                                                                                             \
+        geo_unmap(root, vpn, levels, bits, top_bits);                                                             \
+    }
+
+DEFINE_GEOMETRY(x86_4level, 4, 9, 9)
+DEFINE_GEOMETRY(x86_5level, 5, 9, 9)
+DEFINE_GEOMETRY(arm_16k, 4, 11, 1)
+DEFINE_GEOMETRY(arm_64k, 3, 13, 6)
+
+struct geometry
+{
+    struct pt_geometry_info info;
+    uint64_t (*query)(uint64_t root, uint64_t vpn);
+    void (*map)(uint64_t root, uint64_t vpn, uint64_t ppn);
+    void (*unmap)(uint64_t root, uint64_t vpn);
+};
+
+static const struct geometry geometries[PT_GEOMETRIES] = {
+    [PT_GEOMETRY_DEFAULT] = {{"default", PT_LEVELS, SYMBOL_BITS, SYMBOL_BITS, OFFSET_BITS}, NULL, NULL, NULL},
+    [PT_GEOMETRY_4K_48] = {{"4K/48-bit", 4, 9, 9, 12}, x86_4level_query, x86_4level_map, x86_4level_unmap},
+    [PT_GEOMETRY_4K_57] = {{"4K/57-bit", 5, 9, 9, 12}, x86_5level_query, x86_5level_map, x86_5level_unmap},
+    [PT_GEOMETRY_16K_48] = {{"16K/48-bit", 4, 11, 1, 14}, arm_16k_query, arm_16k_map, arm_16k_unmap},
+    [PT_GEOMETRY_64K_48] = {{"64K/48-bit", 3, 13, 6, 16}, arm_64k_query, arm_64k_map, arm_64k_unmap},
+};
+
+uint64_t page_table_create(enum pt_geometry geometry)
+{
+    if (geometry < 0 || geometry >= PT_GEOMETRIES)
+        errx(1, "page_table_create: unknown geometry %d", geometry);
+    if (geometry == PT_GEOMETRY_DEFAULT)
+        return alloc_page_frame();
+
+    // The root is sized by its own index bits, it isn't accounted as a node like the default roots
+    const struct pt_geometry_info *info = &geometries[geometry].info;
+    unsigned int frames = node_frames(info->top_bits);
+    uint64_t root = (frames == 1) ? alloc_page_frame() : alloc_page_frames(frames);
+
+    return root | ((uint64_t)geometry << PT_KIND_SHIFT);
+}
+
+const struct pt_geometry_info *pt_geometry_info(enum pt_geometry geometry)
+{
+    if (geometry < 0 || geometry >= PT_GEOMETRIES)
+        errx(1, "pt_geometry_info: unknown geometry %d", geometry);
+    return &geometries[geometry].info;
+}
+
+uint64_t geometry_query(uint64_t pt, uint64_t vpn)
+{
+    return geometries[table_kind(pt)].query(table_root(pt), vpn);
+}
+
+void geometry_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    if (ppn == NO_MAPPING)
+    {
+        geometries[table_kind(pt)].unmap(table_root(pt), vpn);
+    }
+    else
+    {
+        geometries[table_kind(pt)].map(table_root(pt), vpn, ppn);
+    }
+}
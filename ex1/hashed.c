@@ -0,0 +1,189 @@
+#include <err.h>
+#include <string.h>
+
+#include "pt_internal.h"
+
+/*
+ * The root frame of a hashed table only holds its header. The buckets live in a separate run of
+ * contiguous frames, probed linearly one bucket (= one cache line) at a time. A removed pair
+ * leaves a tombstone behind, so that the probe sequences of the pairs after it stay intact, and
+ * the table is rebuilt once live pairs and tombstones fill three quarters of it.
+ */
+
+#define BUCKET_SLOTS 4
+#define EMPTY_VPN (~0ULL)
+#define TOMBSTONE_VPN (~1ULL)
+
+struct bucket
+{
+    uint64_t vpns[BUCKET_SLOTS];
+    uint64_t ppns[BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+struct hashed_header
+{
+    uint64_t table;   // First frame of the buckets
+    uint64_t buckets; // A power of 2
+    uint64_t count;   // Live pairs
+    uint64_t tombstones;
+};
+
+static struct hashed_header *header(uint64_t pt)
+{
+    return (struct hashed_header *)phys_to_virt(table_root(pt) << OFFSET_BITS);
+}
+
+static unsigned int table_frames(uint64_t buckets)
+{
+    return (buckets * sizeof(struct bucket) + (1 << OFFSET_BITS) - 1) >> OFFSET_BITS;
+}
+
+static uint64_t bucket_of(uint64_t vpn, uint64_t buckets)
+{
+    return (hash_key(vpn) >> 32) & (buckets - 1);
+}
+
+/**
+ * Points the header at a fresh table of the given number of buckets, with every slot empty.
+ */
+static struct bucket *alloc_table(struct hashed_header *h, uint64_t buckets)
+{
+    h->table = alloc_wide_node(table_frames(buckets));
+    h->buckets = buckets;
+    h->count = 0;
+    h->tombstones = 0;
+
+    struct bucket *table = phys_to_virt(h->table << OFFSET_BITS);
+    memset(table, 0xff, buckets * sizeof(struct bucket));
+    return table;
+}
+
+uint64_t page_table_create_hashed(void)
+{
+    uint64_t root = alloc_page_frame();
+
+    // One frame worth of buckets to start with
+    alloc_table(phys_to_virt(root << OFFSET_BITS), (1 << OFFSET_BITS) / sizeof(struct bucket));
+    return root | ((uint64_t)PT_KIND_HASHED << PT_KIND_SHIFT);
+}
+
+/**
+ * Returns the bucket that holds vpn and sets *slot to its slot, or returns NULL if vpn isn't mapped.
+ */
+static struct bucket *find_pair(struct hashed_header *h, struct bucket *table, uint64_t vpn, int *slot)
+{
+    for (uint64_t b = bucket_of(vpn, h->buckets);; b = (b + 1) & (h->buckets - 1))
+    {
+        struct bucket *bucket = &table[b];
+        for (int s = 0; s < BUCKET_SLOTS; s++)
+        {
+            if (bucket->vpns[s] == vpn)
+            {
+                *slot = s;
+                return bucket;
+            }
+            if (bucket->vpns[s] == EMPTY_VPN)
+            {
+                return NULL;
+            }
+        }
+    }
+}
+
+uint64_t hashed_query(uint64_t pt, uint64_t vpn)
+{
+    struct hashed_header *h = header(pt);
+    int slot;
+
+    if (vpn >= TOMBSTONE_VPN)
+    {
+        return NO_MAPPING;
+    }
+    struct bucket *bucket = find_pair(h, phys_to_virt(h->table << OFFSET_BITS), vpn, &slot);
+
+    return (bucket != NULL) ? bucket->ppns[slot] : NO_MAPPING;
+}
+
+/**
+ * Stores a pair that isn't in the table yet into the first free slot of its probe sequence.
+ */
+static void insert_pair(struct hashed_header *h, struct bucket *table, uint64_t vpn, uint64_t ppn)
+{
+    for (uint64_t b = bucket_of(vpn, h->buckets);; b = (b + 1) & (h->buckets - 1))
+    {
+        for (int s = 0; s < BUCKET_SLOTS; s++)
+        {
+            if (table[b].vpns[s] == EMPTY_VPN || table[b].vpns[s] == TOMBSTONE_VPN)
+            {
+                h->tombstones -= (table[b].vpns[s] == TOMBSTONE_VPN);
+                h->count++;
+                table[b].vpns[s] = vpn;
+                table[b].ppns[s] = ppn;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Moves the live pairs into a new table with room for twice as many (or as many, when it was
+ * mostly tombstones), and frees the old one.
+ */
+static void rebuild(struct hashed_header *h)
+{
+    struct hashed_header old = *h;
+    struct bucket *old_table = phys_to_virt(old.table << OFFSET_BITS);
+    uint64_t slots = old.buckets * BUCKET_SLOTS;
+    struct bucket *table = alloc_table(h, (old.count * 8 > slots * 3) ? old.buckets * 2 : old.buckets);
+
+    for (uint64_t b = 0; b < old.buckets; b++)
+    {
+        for (int s = 0; s < BUCKET_SLOTS; s++)
+        {
+            if (old_table[b].vpns[s] < TOMBSTONE_VPN)
+            {
+                insert_pair(h, table, old_table[b].vpns[s], old_table[b].ppns[s]);
+            }
+        }
+    }
+    free_wide_node(old.table, table_frames(old.buckets));
+}
+
+void hashed_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    struct hashed_header *h = header(pt);
+    struct bucket *table = phys_to_virt(h->table << OFFSET_BITS);
+
+    if (pt_concurrent)
+        errx(1, "hashed tables can't be updated in concurrent mode");
+    if (vpn >= TOMBSTONE_VPN)
+        errx(1, "vpn %llx can't be mapped in a hashed table", (unsigned long long)vpn);
+
+    int slot;
+    struct bucket *bucket = find_pair(h, table, vpn, &slot);
+    if (bucket != NULL)
+    {
+        if (ppn == NO_MAPPING)
+        {
+            bucket->vpns[slot] = TOMBSTONE_VPN;
+            h->count--;
+            h->tombstones++;
+        }
+        else
+        {
+            bucket->ppns[slot] = ppn;
+        }
+        return;
+    }
+
+    if (ppn == NO_MAPPING)
+    {
+        return;
+    }
+    if ((h->count + h->tombstones + 1) * 4 > h->buckets * BUCKET_SLOTS * 3)
+    {
+        rebuild(h);
+        table = phys_to_virt(h->table << OFFSET_BITS);
+    }
+    insert_pair(h, table, vpn, ppn);
+}
@@ -0,0 +1,269 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+/*
+ * The guest table has the shape of the default tree, but its entries hold guest-physical frame
+ * numbers (gppns), of its nodes as well as of its pages, and only the host table knows which host
+ * frame backs each gppn. So a translation takes a host walk for every guest node it reads and one
+ * more for the page it ends at: up to (PT_LEVELS + 1)^2 - 1 entries read, against PT_LEVELS natively.
+ *
+ * Two caches cut that down. The combined cache maps a guest vpn straight to its host ppn, and a hit
+ * reads nothing. The nested-walk cache maps gppns to host ppns, so the host walks of the guest's
+ * upper nodes, which every translation of a region shares, are mostly skipped. Both are direct-mapped.
+ */
+
+struct combined_entry
+{
+    uint64_t gvpn; // NO_MAPPING when empty
+    uint64_t hppn;
+};
+
+struct nwc_entry
+{
+    uint64_t gppn; // NO_MAPPING when empty
+    uint64_t hppn;
+};
+
+struct pt_nested
+{
+    uint64_t host_pt;
+    uint64_t root_gppn;
+    uint64_t next_gppn; // The gppn the next guest node gets
+
+    struct combined_entry *combined;
+    struct nwc_entry *nwc;
+    uint64_t combined_mask; // Entries - 1, or NO_MAPPING while disabled
+    uint64_t nwc_mask;
+    struct pt_nested_stats stats;
+};
+
+static uint64_t cache_slot(uint64_t key, uint64_t mask)
+{
+    return (hash_key(key) >> 32) & mask;
+}
+
+/**
+ * Walks the host table for gppn, counting the entries it reads, and returns the host ppn.
+ */
+static uint64_t host_walk(struct pt_nested *n, uint64_t gppn)
+{
+    uint64_t frame = table_root(n->host_pt);
+
+    for (int level = 0; level < PT_LEVELS; level++)
+    {
+        uint64_t pte = ((uint64_t *)phys_to_virt(frame << OFFSET_BITS))[get_index(gppn, level)];
+
+        n->stats.references++;
+        if (!is_valid_pte(pte))
+        {
+            return NO_MAPPING;
+        }
+        if (level == PT_LEVELS - 1 || is_huge_pte(pte))
+        {
+            return leaf_ppn(pte, gppn, level);
+        }
+        frame = get_frame_number(pte);
+    }
+    return NO_MAPPING;
+}
+
+/**
+ * Translates a gppn to the host ppn that backs it, through the nested-walk cache.
+ */
+static uint64_t host_translate(struct pt_nested *n, uint64_t gppn)
+{
+    struct nwc_entry *entry = NULL;
+
+    if (n->nwc != NULL)
+    {
+        entry = &n->nwc[cache_slot(gppn, n->nwc_mask)];
+        if (entry->gppn == gppn)
+        {
+            n->stats.nwc_hits++;
+            return entry->hppn;
+        }
+        n->stats.nwc_misses++;
+    }
+
+    uint64_t hppn = host_walk(n, gppn);
+    if (entry != NULL && hppn != NO_MAPPING)
+    {
+        *entry = (struct nwc_entry){gppn, hppn};
+    }
+    return hppn;
+}
+
+/**
+ * Returns the host address of a guest node.
+ */
+static uint64_t *guest_node(struct pt_nested *n, uint64_t gppn)
+{
+    uint64_t hppn = host_translate(n, gppn);
+
+    if (hppn == NO_MAPPING)
+        errx(1, "pt_nested: guest node %llx isn't backed by the host", (unsigned long long)gppn);
+    return (uint64_t *)phys_to_virt(hppn << OFFSET_BITS);
+}
+
+/**
+ * Takes the next gppn for a guest node, and backs it with a fresh host frame if it isn't yet.
+ */
+static uint64_t alloc_guest_node(struct pt_nested *n)
+{
+    uint64_t gppn = n->next_gppn++;
+
+    // The host backs the node on first use, as a hypervisor faults in guest memory
+    if (page_table_query(n->host_pt, gppn) == NO_MAPPING)
+    {
+        page_table_update(n->host_pt, gppn, alloc_page_frame());
+    }
+    else
+    {
+        uint64_t *node = guest_node(n, gppn);
+        for (int j = 0; j <= SYMBOL_MASK; j++)
+        {
+            node[j] = 0;
+        }
+    }
+    return gppn;
+}
+
+static void *alloc_cache(unsigned int entries, size_t size, uint64_t *mask)
+{
+    if (entries == 0)
+    {
+        *mask = NO_MAPPING;
+        return NULL;
+    }
+    if ((entries & (entries - 1)) != 0)
+        errx(1, "pt_nested_create: cache sizes must be powers of 2");
+
+    void *cache = malloc(entries * size);
+    if (cache == NULL)
+        err(1, "pt_nested_create: malloc failed");
+
+    // Both kinds of entries start with their key, and all ones is never a valid key
+    for (unsigned int i = 0; i < entries; i++)
+    {
+        *(uint64_t *)((char *)cache + i * size) = NO_MAPPING;
+    }
+    *mask = entries - 1;
+    return cache;
+}
+
+struct pt_nested *pt_nested_create(uint64_t host_pt, uint64_t table_gppn, unsigned int combined_entries,
+                                   unsigned int nwc_entries)
+{
+    if (table_kind(host_pt) != PT_GEOMETRY_DEFAULT)
+        errx(1, "pt_nested_create: the host table must be of the default geometry");
+
+    struct pt_nested *n = calloc(1, sizeof(struct pt_nested));
+    if (n == NULL)
+        err(1, "pt_nested_create: calloc failed");
+
+    n->host_pt = host_pt;
+    n->next_gppn = table_gppn;
+    n->combined = alloc_cache(combined_entries, sizeof(struct combined_entry), &n->combined_mask);
+    n->nwc = alloc_cache(nwc_entries, sizeof(struct nwc_entry), &n->nwc_mask);
+    n->root_gppn = alloc_guest_node(n);
+    return n;
+}
+
+void pt_nested_destroy(struct pt_nested *n)
+{
+    free(n->combined);
+    free(n->nwc);
+    free(n);
+}
+
+void pt_nested_map(struct pt_nested *n, uint64_t gvpn, uint64_t gppn)
+{
+    uint64_t node_gppn = n->root_gppn;
+
+    for (int level = 0; level < PT_LEVELS - 1; level++)
+    {
+        uint64_t *pte = &guest_node(n, node_gppn)[get_index(gvpn, level)];
+        if (!is_valid_pte(*pte))
+        {
+            if (gppn == NO_MAPPING)
+            {
+                return;
+            }
+            *pte = create_pte(alloc_guest_node(n));
+        }
+        node_gppn = get_frame_number(*pte);
+    }
+
+    guest_node(n, node_gppn)[get_index(gvpn, PT_LEVELS - 1)] = (gppn == NO_MAPPING) ? 0 : create_pte(gppn);
+    if (n->combined != NULL && n->combined[cache_slot(gvpn, n->combined_mask)].gvpn == gvpn)
+    {
+        n->combined[cache_slot(gvpn, n->combined_mask)].gvpn = NO_MAPPING;
+    }
+}
+
+uint64_t pt_nested_translate(struct pt_nested *n, uint64_t gvpn)
+{
+    struct combined_entry *entry = NULL;
+
+    n->stats.translations++;
+    if (n->combined != NULL)
+    {
+        entry = &n->combined[cache_slot(gvpn, n->combined_mask)];
+        if (entry->gvpn == gvpn)
+        {
+            n->stats.combined_hits++;
+            return entry->hppn;
+        }
+    }
+
+    // The 2D walk: every guest node is found through the host before its entry is read
+    n->stats.walks++;
+    uint64_t gppn = n->root_gppn;
+    for (int level = 0; level < PT_LEVELS; level++)
+    {
+        uint64_t hppn = host_translate(n, gppn);
+        if (hppn == NO_MAPPING)
+        {
+            return NO_MAPPING;
+        }
+
+        uint64_t pte = ((uint64_t *)phys_to_virt(hppn << OFFSET_BITS))[get_index(gvpn, level)];
+        n->stats.references++;
+        if (!is_valid_pte(pte))
+        {
+            return NO_MAPPING;
+        }
+        gppn = get_frame_number(pte);
+    }
+
+    uint64_t hppn = host_translate(n, gppn);
+    if (entry != NULL && hppn != NO_MAPPING)
+    {
+        *entry = (struct combined_entry){gvpn, hppn};
+    }
+    return hppn;
+}
+
+void pt_nested_flush(struct pt_nested *n)
+{
+    for (uint64_t i = 0; n->combined != NULL && i <= n->combined_mask; i++)
+    {
+        n->combined[i].gvpn = NO_MAPPING;
+    }
+    for (uint64_t i = 0; n->nwc != NULL && i <= n->nwc_mask; i++)
+    {
+        n->nwc[i].gppn = NO_MAPPING;
+    }
+}
+
+void pt_nested_get_stats(struct pt_nested *n, struct pt_nested_stats *stats)
+{
+    *stats = n->stats;
+}
+
+void pt_nested_reset_stats(struct pt_nested *n)
+{
+    n->stats = (struct pt_nested_stats){0};
+}
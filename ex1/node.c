@@ -0,0 +1,119 @@
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+// ---------------------------------- Node metadata ----------------------------------
+
+// The metadata table is a 2-level radix tree indexed by frame number, so it never moves
+#define META_CHUNK_BITS 12
+#define META_CHUNKS (1 << 20)
+
+static struct node_meta *meta_chunks[META_CHUNKS];
+
+struct node_meta *node_meta(uint64_t frame)
+{
+    uint64_t chunk = frame >> META_CHUNK_BITS;
+
+    if (chunk >= META_CHUNKS)
+        errx(1, "node_meta: frame %llx is out of range", (unsigned long long)frame);
+
+    struct node_meta *metas = __atomic_load_n(&meta_chunks[chunk], __ATOMIC_ACQUIRE);
+    if (metas == NULL)
+    {
+        struct node_meta *fresh = calloc(1 << META_CHUNK_BITS, sizeof(struct node_meta));
+        if (fresh == NULL)
+            err(1, "node_meta: calloc failed");
+
+        // Another thread may be creating the same chunk, the first one to publish it wins
+        if (__atomic_compare_exchange_n(&meta_chunks[chunk], &metas, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            metas = fresh;
+        }
+        else
+        {
+            free(fresh);
+        }
+    }
+    return &metas[frame & ((1 << META_CHUNK_BITS) - 1)];
+}
+
+// ----------------------------------- Node frames -----------------------------------
+
+static atomic_uint_fast64_t nodes_in_use;
+
+uint64_t alloc_node(void)
+{
+    // Frames come zero filled from the allocator
+    uint64_t frame = alloc_page_frame();
+
+    *node_meta(frame) = (struct node_meta){0};
+    nodes_in_use++;
+    return frame;
+}
+
+void free_node(uint64_t frame)
+{
+    // The frame may come back as a root, which starts out with whatever metadata it had
+    *node_meta(frame) = (struct node_meta){0};
+    free_page_frame(frame);
+    nodes_in_use--;
+}
+
+void free_root(uint64_t frame)
+{
+    // Roots aren't counted as nodes, but they keep live counts and occupancy all the same
+    *node_meta(frame) = (struct node_meta){0};
+    free_page_frame(frame);
+}
+
+uint64_t alloc_wide_node(unsigned int frames)
+{
+    uint64_t frame = (frames == 1) ? alloc_page_frame() : alloc_page_frames(frames);
+
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        *node_meta(frame + i) = (struct node_meta){0};
+    }
+    nodes_in_use += frames;
+    return frame;
+}
+
+void free_wide_node(uint64_t frame, unsigned int frames)
+{
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        *node_meta(frame + i) = (struct node_meta){0};
+        free_page_frame(frame + i);
+    }
+    nodes_in_use -= frames;
+}
+
+void free_subtree(uint64_t frame, int level)
+{
+    uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+    struct node_meta *meta = node_meta(frame);
+
+    if (meta->sharers > 0)
+    {
+        // Another table still points at the node (and through it, at everything below)
+        meta->sharers--;
+        return;
+    }
+
+    for (int j = 0; level < PT_LEVELS - 1 && j <= SYMBOL_MASK; j++)
+    {
+        if (is_valid_pte(node[j]) && !is_huge_pte(node[j]))
+        {
+            free_subtree(get_frame_number(node[j]), level + 1);
+        }
+    }
+    free_node(frame);
+}
+
+void pt_get_footprint(struct pt_footprint *footprint)
+{
+    footprint->node_frames = nodes_in_use;
+    footprint->rmap_mappings = rmap_mappings();
+}
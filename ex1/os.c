@@ -1,219 +1,213 @@
 #define _GNU_SOURCE
 
-#include <assert.h>
 #include <err.h>
-#include <execinfo.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
-#include <time.h>
 
 #include "os.h"
 
-#include "math.h"
-
 /* 2^20 pages ought to be enough for anybody */
 #define NPAGES (1024 * 1024)
 
-#define VPN_MASK 0x1FFFFFFFFFFF
-#define PPN_MASK 0xFFFFFFFFFFFFF
-
 static uint64_t *pages[NPAGES];
+static atomic_uint_fast64_t nalloc;
 
-uint64_t alloc_page_frame(void)
-{
-    static uint64_t nalloc;
-    uint64_t ppn;
-    void *va;
+/* Arena mode: frame ppn lives at arena + (ppn << 12) */
+static char *arena;
+static uint64_t arena_frames;
 
-    if (nalloc == NPAGES)
-        errx(1, "out of physical memory");
+void init_page_frame_arena(uint64_t nframes, int hugepages)
+{
+    size_t size = nframes << 12;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *va = MAP_FAILED;
 
-    /* OS memory management isn't really this simple */
-    ppn = nalloc;
-    nalloc++;
+    if (nalloc != 0 || arena != NULL)
+        errx(1, "the frame arena must be set up before the first allocation");
 
-    va = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (hugepages)
+    {
+        /* Explicit huge pages must be reserved up front (or faults SIGBUS), otherwise use transparent ones */
+        size = (size + (1 << 21) - 1) & ~(size_t)((1 << 21) - 1);
+        va = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    }
     if (va == MAP_FAILED)
-        err(1, "mmap failed");
+    {
+        va = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, -1, 0);
+        if (va == MAP_FAILED)
+            err(1, "mmap of the frame arena failed");
+        if (hugepages)
+            madvise(va, size, MADV_HUGEPAGE);
+    }
 
-    pages[ppn] = va;
-    return ppn;
+    arena = va;
+    arena_frames = nframes;
 }
 
-void *phys_to_virt(uint64_t phys_addr)
-{
-    uint64_t ppn = phys_addr >> 12;
-    uint64_t off = phys_addr & 0xfff;
-    void *va = NULL;
+/*
+ * Freed frames are linked through their first word into a shared list. Each thread keeps up to
+ * FRAME_CACHE_SIZE of them to itself and only takes the lock to move FRAME_CACHE_BATCH at a time.
+ */
+#define FRAME_CACHE_SIZE 64
+#define FRAME_CACHE_BATCH (FRAME_CACHE_SIZE / 2)
 
-    if (ppn < NPAGES)
-        va = pages[ppn] + off;
+struct frame_cache
+{
+    uint64_t frames[FRAME_CACHE_SIZE];
+    unsigned int count;
+    int registered;
+};
 
-    return va;
-}
+static _Thread_local struct frame_cache cache;
 
-// TESTS FUNCTIONS
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t free_head = ~0ULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
 
-void assert_equal(uint64_t received, uint64_t expected)
+static uint64_t *frame_link(uint64_t ppn)
 {
-    static int counter = 0;
+    return (uint64_t *)phys_to_virt(ppn << 12);
+}
 
-    if (expected != received)
+/* Moves count frames from the top of a thread's cache to the shared list */
+static void drain_cache(struct frame_cache *c, unsigned int count)
+{
+    pthread_mutex_lock(&free_lock);
+    for (; count > 0; count--)
     {
-        printf("\n\033[0;31mFailed test!\nExpected \033[0m\033[0;32m%llX\033[0m\033[0;31m and received "
-               "\033[0m\033[0;33m%llX\033[0m\033[0;31m.\033[0m\n",
-               (long long unsigned int)expected, (long long unsigned int)received);
-
-        void *callstack[128];
-        int i, frames = backtrace(callstack, 128);
-        char **strs = backtrace_symbols(callstack, frames);
-        printf("\033[0;36m(Almost readable) stacktrace\n");
-        for (i = 0; i < frames; ++i)
-        {
-            printf("%s\n", strs[i]);
-        }
-        printf("\033[0m\n");
-        free(strs);
-
-        assert(0);
+        uint64_t ppn = c->frames[--c->count];
+        *frame_link(ppn) = free_head;
+        __atomic_store_n(&free_head, ppn, __ATOMIC_RELAXED);
     }
-
-    if (counter % 500 == 0)
-        printf("\033[0;32m.\033[0m");
-    counter++;
+    pthread_mutex_unlock(&free_lock);
 }
 
-uint64_t get_random(uint64_t mask)
+/* A thread that exits hands its cached frames back */
+static void release_cache(void *c)
 {
-    return rand() & mask;
+    drain_cache(c, ((struct frame_cache *)c)->count);
 }
 
-int in_array(uint64_t *arr, int size, uint64_t value)
+static void create_cache_key(void)
 {
-    for (int i = 0; i < size; i++)
-        if (arr[i] == value)
-            return 1;
-    return 0;
+    if (pthread_key_create(&cache_key, release_cache) != 0)
+        errx(1, "pthread_key_create failed");
 }
 
-void get_random_list(uint64_t **out, int size, uint64_t mask)
+/* Makes the calling thread hand its cache back when it exits, before the cache first holds a frame */
+static void register_cache(void)
 {
-    *out = calloc(size, sizeof(uint64_t));
-    uint64_t *arr = *out;
-    int count = 0;
-    uint64_t val;
-
-    while (count < size)
+    if (!cache.registered)
     {
-        val = get_random(mask);
-
-        if (!in_array(arr, count, val))
-        {
-            arr[count] = val;
-            count++;
-        }
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = 1;
     }
 }
 
-uint64_t get_random_vpn()
+/* Moves up to FRAME_CACHE_BATCH frames from the shared list into the calling thread's cache */
+static void refill_cache(void)
 {
-    return get_random(VPN_MASK);
+    // Until something is freed, every frame is a fresh one, which needs no lock. A frame freed
+    // just now may be missed, and waits on the list for the next refill.
+    if (__atomic_load_n(&free_head, __ATOMIC_RELAXED) == ~0ULL)
+        return;
+
+    register_cache();
+    pthread_mutex_lock(&free_lock);
+    while (cache.count < FRAME_CACHE_BATCH && free_head != ~0ULL)
+    {
+        cache.frames[cache.count++] = free_head;
+        __atomic_store_n(&free_head, *frame_link(free_head), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&free_lock);
 }
 
-uint64_t get_random_ppn()
+uint64_t alloc_page_frame(void)
 {
-    return get_random(VPN_MASK);
-}
+    uint64_t ppn;
+    void *va;
 
-void update_random_and_check(uint64_t pt)
-{
-    uint64_t vpn = get_random_vpn();
-    uint64_t ppn = get_random_ppn();
+    if (cache.count == 0)
+        refill_cache();
+    if (cache.count > 0)
+    {
+        ppn = cache.frames[--cache.count];
+        memset(phys_to_virt(ppn << 12), 0, 4096);
+        return ppn;
+    }
 
-    if (rand() % 10 < 3)
-        ppn = NO_MAPPING;
+    /* OS memory management isn't really this simple */
+    ppn = atomic_fetch_add(&nalloc, 1);
 
-    page_table_update(pt, vpn, ppn);
-    assert_equal(page_table_query(pt, vpn), ppn);
-}
+    if (arena != NULL)
+    {
+        if (ppn >= arena_frames)
+            errx(1, "out of physical memory");
+        return ppn;
+    }
 
-void update_many_with_prefix(uint64_t pt)
-{
-    int prefix = (rand() % 45) + 1;
-    uint64_t mask = pow(2, prefix + 1) - 1;
-    uint64_t vpn_mask = pow(2, (45 - prefix) + 1) - 1;
-    int amount = (rand() % 20) + 2;
+    if (ppn >= NPAGES)
+        errx(1, "out of physical memory");
 
-    if (amount > vpn_mask / 2)
-        amount = vpn_mask / 2;
+    va = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (va == MAP_FAILED)
+        err(1, "mmap failed");
 
-    uint64_t block = get_random(mask) << prefix;
-    uint64_t *vpn_arr;
-    uint64_t *ppn_arr = malloc(sizeof(uint64_t) * amount);
+    pages[ppn] = va;
+    return ppn;
+}
 
-    get_random_list(&vpn_arr, amount, vpn_mask);
-    for (int i = 0; i < amount; i++)
-    {
-        vpn_arr[i] = block + vpn_arr[i];
-        ppn_arr[i] = get_random_ppn();
+uint64_t alloc_page_frames(unsigned int count)
+{
+    uint64_t ppn;
+    char *va;
 
-        page_table_update(pt, vpn_arr[i], ppn_arr[i]);
-        assert_equal(page_table_query(pt, vpn_arr[i]), ppn_arr[i]);
-    }
+    ppn = atomic_fetch_add(&nalloc, count);
 
-    for (int i = 0; i < amount; i++)
+    if (arena != NULL)
     {
-        uint64_t value = page_table_query(pt, vpn_arr[i]);
-        uint64_t expected = ppn_arr[i];
-        if (value != expected)
-        {
-            printf("Set values:\n");
-            for (int j = 0; j < amount; j++)
-                printf("page_table[%llX] = %llX\n", (long long unsigned int)vpn_arr[j],
-                       (long long unsigned int)ppn_arr[j]);
-            printf("\nFailed on index %d,\ngot value %llX instead of %llX\n", i, (long long unsigned int)value,
-                   (long long unsigned int)expected);
-            assert(0);
-        }
+        if (ppn + count > arena_frames)
+            errx(1, "out of physical memory");
+        return ppn;
     }
 
-    free(vpn_arr);
-    free(ppn_arr);
+    if (ppn + count > NPAGES)
+        errx(1, "out of physical memory");
+
+    va = mmap(NULL, (size_t)count << 12, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (va == MAP_FAILED)
+        err(1, "mmap failed");
+
+    for (unsigned int i = 0; i < count; i++)
+        pages[ppn + i] = (uint64_t *)(va + ((size_t)i << 12));
+    return ppn;
 }
 
-void perform_random_move(uint64_t pt)
+void free_page_frame(uint64_t ppn)
 {
-    int option = rand() % 2;
-
-    switch (option)
-    {
-    case 0:
-        update_random_and_check(pt);
-        break;
-    case 1:
-        update_many_with_prefix(pt);
-        break;
-    }
+    register_cache();
+    if (cache.count == FRAME_CACHE_SIZE)
+        drain_cache(&cache, FRAME_CACHE_BATCH);
+    cache.frames[cache.count++] = ppn;
 }
 
-int main(int argc, char **argv)
+void *phys_to_virt(uint64_t phys_addr)
 {
-    srand(time(NULL));
-    uint64_t pt = alloc_page_frame();
+    uint64_t ppn = phys_addr >> 12;
+    uint64_t off = phys_addr & 0xfff;
+    void *va = NULL;
 
-    assert_equal(page_table_query(pt, 0xcafe), NO_MAPPING);
-    page_table_update(pt, 0xcafe, 0xf00d);
-    assert_equal(page_table_query(pt, 0xcafe), 0xf00d);
-    page_table_update(pt, 0xcafe, NO_MAPPING);
-    assert_equal(page_table_query(pt, 0xcafe), NO_MAPPING);
+    if (arena != NULL)
+        return (ppn < arena_frames) ? arena + phys_addr : NULL;
 
-    for (int i = 0; i < pow(2, 15); i++)
-    {
-        perform_random_move(pt);
-    }
-    printf("\nAll tests passed!\n");
+    if (ppn < NPAGES)
+        va = pages[ppn] + off;
 
-    return 0;
-}
\ No newline at end of file
+    return va;
+}
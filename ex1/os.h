@@ -6,6 +6,25 @@
 uint64_t alloc_page_frame(void);
 void* phys_to_virt(uint64_t phys_addr);
 
+/*
+ * Allocates count frames that are also contiguous through phys_to_virt, and returns the first.
+ * They are always fresh frames, as recycled ones come back one at a time.
+ */
+uint64_t alloc_page_frames(unsigned int count);
+
+/*
+ * Returns a frame to the allocator. Freed frames are recycled (zeroed) by later allocations,
+ * through a small per-thread cache in front of a shared free list.
+ */
+void free_page_frame(uint64_t ppn);
+
+/*
+ * Arena mode: reserves nframes frames in one region up front (backed by huge pages if asked and
+ * available), hands them out by bumping an index and makes phys_to_virt pure arithmetic.
+ * Must be called before the first alloc_page_frame.
+ */
+void init_page_frame_arena(uint64_t nframes, int hugepages);
+
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
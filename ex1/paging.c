@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pt_internal.h"
+
+/*
+ * The pager owns a run of contiguous frames, so the slot of a resident page is its ppn minus the
+ * first one and a hit needs nothing but the table's translation. Every slot remembers its vpn and
+ * the referenced and dirty bits of its page. A fault takes the next unused slot while there is
+ * one, and otherwise asks the policy for a victim slot, unmaps its page and maps the new one there.
+ *
+ * FIFO and Clock both turn a hand over the slots (a slot refilled in place goes to the back of
+ * the queue). The LRU approximation ages every slot once per round of frames accesses, and picks
+ * the oldest of LRU_SAMPLES slots at the hand. ARC keeps its four lists over the resident slots and
+ * a pool of ghost entries, which a hash table finds by vpn.
+ */
+
+#define LRU_SAMPLES 8
+#define ARC_NIL UINT32_MAX
+
+struct slot
+{
+    uint64_t vpn;
+    uint8_t referenced;
+    uint8_t dirty;
+    uint8_t age; // LRU: one bit per aging round, the most recent on top
+};
+
+enum arc_list
+{
+    T1, // Resident, seen once recently
+    T2, // Resident, seen at least twice recently
+    B1, // Ghosts evicted from T1
+    B2, // Ghosts evicted from T2
+    ARC_LISTS
+};
+
+struct arc_entry
+{
+    uint64_t vpn;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t hnext; // Ghosts only: the next ghost of the same hash bucket
+    uint8_t list;
+};
+
+struct arc
+{
+    // Entry s < frames is the one of slot s, ghosts are [frames, 2 * frames),
+    // and entry 2 * frames + l is the sentinel of list l
+    struct arc_entry *entries;
+    uint64_t sizes[ARC_LISTS];
+    uint64_t target; // p, the size T1 aims for
+    uint32_t free;   // Unused ghosts, linked by next
+    uint32_t *buckets;
+    uint64_t bucket_mask;
+};
+
+struct pt_pager
+{
+    uint64_t pt;
+    enum pt_policy policy;
+    uint64_t first; // Ppn of slot 0
+    uint64_t frames;
+    uint64_t used; // Slots handed out so far
+    uint64_t hand;
+    uint64_t ticks; // Accesses since the last aging round
+    struct slot *slots;
+    struct arc arc;
+    struct pt_pager_stats stats;
+};
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// -------------------------------------- ARC --------------------------------------
+
+static uint32_t sentinel(struct pt_pager *pager, enum arc_list list)
+{
+    return 2 * pager->frames + list;
+}
+
+static void arc_unlink(struct pt_pager *pager, uint32_t e)
+{
+    struct arc_entry *entries = pager->arc.entries;
+
+    entries[entries[e].prev].next = entries[e].next;
+    entries[entries[e].next].prev = entries[e].prev;
+    pager->arc.sizes[entries[e].list]--;
+}
+
+/**
+ * Appends entry e at the MRU end of list.
+ */
+static void arc_push(struct pt_pager *pager, uint32_t e, enum arc_list list)
+{
+    struct arc_entry *entries = pager->arc.entries;
+    uint32_t head = sentinel(pager, list);
+
+    entries[e].list = list;
+    entries[e].prev = entries[head].prev;
+    entries[e].next = head;
+    entries[entries[head].prev].next = e;
+    entries[head].prev = e;
+    pager->arc.sizes[list]++;
+}
+
+static uint32_t arc_lru(struct pt_pager *pager, enum arc_list list)
+{
+    return pager->arc.entries[sentinel(pager, list)].next;
+}
+
+static uint32_t *ghost_bucket(struct arc *arc, uint64_t vpn)
+{
+    return &arc->buckets[(hash_key(vpn) >> 32) & arc->bucket_mask];
+}
+
+static uint32_t ghost_find(struct pt_pager *pager, uint64_t vpn)
+{
+    uint32_t g = *ghost_bucket(&pager->arc, vpn);
+
+    while (g != ARC_NIL && pager->arc.entries[g].vpn != vpn)
+    {
+        g = pager->arc.entries[g].hnext;
+    }
+    return g;
+}
+
+/**
+ * Drops ghost g from its list and from the hash table, and returns it to the pool.
+ */
+static void ghost_remove(struct pt_pager *pager, uint32_t g)
+{
+    struct arc *arc = &pager->arc;
+    uint32_t *link = ghost_bucket(arc, arc->entries[g].vpn);
+
+    while (*link != g)
+    {
+        link = &arc->entries[*link].hnext;
+    }
+    *link = arc->entries[g].hnext;
+    arc_unlink(pager, g);
+    arc->entries[g].next = arc->free;
+    arc->free = g;
+}
+
+/**
+ * Moves the LRU page of list (T1 or T2) to its ghost list, and returns its slot.
+ */
+static uint64_t arc_demote(struct pt_pager *pager, enum arc_list list)
+{
+    struct arc *arc = &pager->arc;
+    uint32_t s = arc_lru(pager, list);
+    uint32_t g = arc->free;
+
+    arc->free = arc->entries[g].next;
+    arc->entries[g].vpn = arc->entries[s].vpn;
+    arc->entries[g].hnext = *ghost_bucket(arc, arc->entries[g].vpn);
+    *ghost_bucket(arc, arc->entries[g].vpn) = g;
+    arc_push(pager, g, (list == T1) ? B1 : B2);
+
+    arc_unlink(pager, s);
+    return s;
+}
+
+/**
+ * ARC's REPLACE: evicts from T1 when it is above its target, from T2 otherwise.
+ */
+static uint64_t arc_replace(struct pt_pager *pager, int in_b2)
+{
+    uint64_t t1 = pager->arc.sizes[T1];
+
+    if (t1 > 0 && (t1 > pager->arc.target || (in_b2 && t1 == pager->arc.target) || pager->arc.sizes[T2] == 0))
+    {
+        return arc_demote(pager, T1);
+    }
+    return arc_demote(pager, T2);
+}
+
+/**
+ * Picks the slot for vpn when every slot is taken, and files vpn's entry in the list it belongs to.
+ * A ghost is always dropped before REPLACE makes a new one, so there are never more than frames.
+ */
+static uint64_t arc_victim(struct pt_pager *pager, uint64_t vpn)
+{
+    struct arc *arc = &pager->arc;
+    uint64_t *sizes = arc->sizes;
+    uint64_t c = pager->frames;
+    uint32_t g = ghost_find(pager, vpn);
+    enum arc_list list = T2;
+    uint64_t s;
+
+    if (g != ARC_NIL && arc->entries[g].list == B1)
+    {
+        uint64_t step = (sizes[B2] > sizes[B1]) ? sizes[B2] / sizes[B1] : 1;
+        arc->target = (arc->target + step < c) ? arc->target + step : c;
+        ghost_remove(pager, g);
+        s = arc_replace(pager, 0);
+    }
+    else if (g != ARC_NIL)
+    {
+        uint64_t step = (sizes[B1] > sizes[B2]) ? sizes[B1] / sizes[B2] : 1;
+        arc->target = (arc->target > step) ? arc->target - step : 0;
+        ghost_remove(pager, g);
+        s = arc_replace(pager, 1);
+    }
+    else
+    {
+        list = T1;
+        if (sizes[T1] + sizes[B1] == c)
+        {
+            if (sizes[T1] < c)
+            {
+                ghost_remove(pager, arc_lru(pager, B1));
+                s = arc_replace(pager, 0);
+            }
+            else
+            {
+                // T1 alone fills the cache: its LRU page goes without leaving a ghost
+                s = arc_lru(pager, T1);
+                arc_unlink(pager, s);
+            }
+        }
+        else
+        {
+            if (sizes[T1] + sizes[T2] + sizes[B1] + sizes[B2] == 2 * c)
+            {
+                ghost_remove(pager, arc_lru(pager, B2));
+            }
+            s = arc_replace(pager, 0);
+        }
+    }
+
+    arc->entries[s].vpn = vpn;
+    arc_push(pager, s, list);
+    return s;
+}
+
+static void arc_init(struct pt_pager *pager)
+{
+    struct arc *arc = &pager->arc;
+    uint64_t c = pager->frames;
+
+    arc->bucket_mask = 1;
+    while (arc->bucket_mask < c)
+    {
+        arc->bucket_mask <<= 1;
+    }
+    arc->entries = malloc((2 * c + ARC_LISTS) * sizeof(struct arc_entry));
+    arc->buckets = malloc(arc->bucket_mask * sizeof(uint32_t));
+    if (arc->entries == NULL || arc->buckets == NULL)
+        err(1, "pt_pager_create: malloc failed");
+
+    for (uint64_t b = 0; b < arc->bucket_mask; b++)
+    {
+        arc->buckets[b] = ARC_NIL;
+    }
+    arc->bucket_mask--;
+    for (int l = 0; l < ARC_LISTS; l++)
+    {
+        uint32_t head = sentinel(pager, l);
+        arc->entries[head].prev = head;
+        arc->entries[head].next = head;
+    }
+    arc->free = ARC_NIL;
+    for (uint64_t g = 2 * c; g > c; g--)
+    {
+        arc->entries[g - 1].next = arc->free;
+        arc->free = g - 1;
+    }
+}
+
+// ------------------------------------- Pager -------------------------------------
+
+struct pt_pager *pt_pager_create(uint64_t pt, uint64_t frames, enum pt_policy policy)
+{
+    if (frames == 0 || frames >= ARC_NIL / 2 - ARC_LISTS)
+        errx(1, "pt_pager_create: a budget of %llu frames isn't supported", (unsigned long long)frames);
+    if (policy >= PT_POLICIES)
+        errx(1, "pt_pager_create: unknown policy %d", policy);
+
+    struct pt_pager *pager = calloc(1, sizeof(struct pt_pager));
+    if (pager == NULL || (pager->slots = calloc(frames, sizeof(struct slot))) == NULL)
+        err(1, "pt_pager_create: calloc failed");
+
+    pager->pt = pt;
+    pager->policy = policy;
+    pager->frames = frames;
+    pager->first = alloc_page_frames(frames);
+    if (policy == PT_POLICY_ARC)
+    {
+        arc_init(pager);
+    }
+    return pager;
+}
+
+void pt_pager_destroy(struct pt_pager *pager)
+{
+    for (uint64_t s = 0; s < pager->used; s++)
+    {
+        page_table_update(pager->pt, pager->slots[s].vpn, NO_MAPPING);
+    }
+    for (uint64_t s = 0; s < pager->frames; s++)
+    {
+        free_page_frame(pager->first + s);
+    }
+    free(pager->arc.entries);
+    free(pager->arc.buckets);
+    free(pager->slots);
+    free(pager);
+}
+
+static uint64_t advance(struct pt_pager *pager)
+{
+    uint64_t s = pager->hand;
+
+    pager->hand = (s + 1 == pager->frames) ? 0 : s + 1;
+    return s;
+}
+
+/**
+ * Picks the slot whose page is evicted to make room for vpn.
+ */
+static uint64_t choose_victim(struct pt_pager *pager, uint64_t vpn)
+{
+    struct slot *slots = pager->slots;
+
+    switch (pager->policy)
+    {
+    case PT_POLICY_FIFO:
+        return advance(pager);
+
+    case PT_POLICY_CLOCK:
+        while (slots[pager->hand].referenced)
+        {
+            slots[advance(pager)].referenced = 0;
+        }
+        return advance(pager);
+
+    case PT_POLICY_LRU:
+    {
+        // A page referenced since the last aging round counts as younger than any other
+        uint64_t victim = pager->hand;
+        for (int i = 0; i < LRU_SAMPLES && i < (int)pager->frames; i++)
+        {
+            uint64_t s = advance(pager);
+            if ((slots[s].referenced << 8 | slots[s].age) < (slots[victim].referenced << 8 | slots[victim].age))
+                victim = s;
+        }
+        return victim;
+    }
+
+    default:
+        return arc_victim(pager, vpn);
+    }
+}
+
+static uint64_t handle_fault(struct pt_pager *pager, uint64_t vpn)
+{
+    uint64_t start = clock_ns();
+    uint64_t s;
+
+    pager->stats.faults++;
+    if (pager->used < pager->frames)
+    {
+        s = pager->used++;
+        if (pager->policy == PT_POLICY_ARC)
+        {
+            pager->arc.entries[s].vpn = vpn;
+            arc_push(pager, s, T1);
+        }
+    }
+    else
+    {
+        s = choose_victim(pager, vpn);
+        page_table_update(pager->pt, pager->slots[s].vpn, NO_MAPPING);
+        pager->stats.evictions++;
+        pager->stats.writebacks += pager->slots[s].dirty;
+    }
+
+    pager->slots[s] = (struct slot){vpn, 0, 0, 0};
+    page_table_update(pager->pt, vpn, pager->first + s);
+    pager->stats.fault_ns += clock_ns() - start;
+    return pager->first + s;
+}
+
+uint64_t pt_pager_access(struct pt_pager *pager, uint64_t vpn, int write)
+{
+    uint64_t ppn = page_table_query(pager->pt, vpn);
+
+    pager->stats.accesses++;
+    if (ppn == NO_MAPPING)
+    {
+        ppn = handle_fault(pager, vpn);
+    }
+    else if (pager->policy == PT_POLICY_ARC)
+    {
+        arc_unlink(pager, ppn - pager->first);
+        arc_push(pager, ppn - pager->first, T2);
+    }
+
+    struct slot *slot = &pager->slots[ppn - pager->first];
+    slot->referenced = 1;
+    slot->dirty |= (write != 0);
+
+    if (pager->policy == PT_POLICY_LRU && ++pager->ticks == pager->frames)
+    {
+        for (uint64_t s = 0; s < pager->used; s++)
+        {
+            pager->slots[s].age = (pager->slots[s].age >> 1) | (pager->slots[s].referenced << 7);
+            pager->slots[s].referenced = 0;
+        }
+        pager->ticks = 0;
+    }
+    return ppn;
+}
+
+void pt_pager_get_stats(struct pt_pager *pager, struct pt_pager_stats *stats)
+{
+    *stats = pager->stats;
+}
@@ -1,63 +1,132 @@
-#include "os.h"
+#include "pt_internal.h"
+#include <err.h>
 #include <stdio.h>
-
-// 5 levels of PTE
-#define PT_LEVELS 5
-#define SYMBOL_BITS 9
-#define OFFSET_BITS 12
-#define PTE_BYTES 8
-
-const uint64_t SYMBOL_MASK = 0x1FF; // mask of 9 lower bits
-const uint64_t VALID_MASK = 0x1;    // mask of the LSB
+#include <string.h>
 
 enum walk_mode
 {
     Search = 0,
-    Destroy = 0,
-    Insert = 1
+    Insert = 1,
+    Destroy = 2
 };
 
+int pt_concurrent;
+int pt_access_tracking;
+
 /**
- * Returns whether a pte (= page table entry) is valid.
+ * Exits for the calls that only tables of the default geometry support.
  */
-uint64_t is_valid_pte(uint64_t pte)
+static void require_default(uint64_t pt, const char *call)
 {
-    return pte & VALID_MASK;
+    if (table_kind(pt) != PT_GEOMETRY_DEFAULT)
+        errx(1, "%s: only tables of the default geometry are supported", call);
+}
+
+void pt_set_concurrent(int on)
+{
+    if (on && rmap_enabled)
+        errx(1, "pt_set_concurrent: the reverse map can't be kept in concurrent mode");
+    if (on && trace_enabled)
+        errx(1, "pt_set_concurrent: operations can't be traced in concurrent mode");
+    if (on)
+    {
+        // Both caches are plain shared arrays, so they can't be kept coherent between threads
+        pt_tlb_disable();
+        pt_psc_disable();
+    }
+    pt_concurrent = on;
 }
 
 /**
- * Creates a pte (= page table entry) structure out of a page frame number.
+ * Replaces a huge pte found at the given level with a node of the next smaller blocks (or pages)
+ * that map exactly the same range, and returns the pte that points at the new node.
  */
-uint64_t create_pte(uint64_t frame_number)
+static uint64_t split_huge_pte(uint64_t pte, int level)
 {
-    return (frame_number << OFFSET_BITS) + VALID_MASK;
+    uint64_t frame = alloc_node();
+    uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+    uint64_t base = get_frame_number(pte);
+    uint64_t span = level_span(level + 1);
+    uint64_t flags = ((level + 1 < PT_LEVELS - 1) ? HUGE_MASK : 0) | (pte & (ACCESSED_MASK | DIRTY_MASK));
+
+    for (uint64_t j = 0; j <= SYMBOL_MASK; j++)
+    {
+        node[j] = create_pte(base + j * span) | flags;
+    }
+    node_meta(frame)->live = SYMBOL_MASK + 1;
+    mark_occupancy(frame, 0, SYMBOL_MASK + 1, 1);
+    return create_pte(frame);
 }
 
 /**
- * Gets the page number out of a pte (= page table entry).
+ * Copies the entries and metadata of the node in frame (at the given level) into the node in copy,
+ * and counts the copy as one more parent of every node below.
  */
-uint64_t get_frame_number(uint64_t pte)
+static void copy_node(uint64_t frame, uint64_t copy, int level)
 {
-    return pte >> OFFSET_BITS;
+    uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+    struct node_meta *meta = node_meta(frame);
+    struct node_meta *copy_meta = node_meta(copy);
+
+    memcpy(phys_to_virt(copy << OFFSET_BITS), node, (SYMBOL_MASK + 1) * PTE_BYTES);
+    copy_meta->live = meta->live;
+    memcpy(copy_meta->occupancy, meta->occupancy, sizeof(meta->occupancy));
+
+    for (int w = 0; level < PT_LEVELS - 1 && w < OCCUPANCY_WORDS; w++)
+    {
+        for (uint64_t bits = meta->occupancy[w]; bits != 0; bits &= bits - 1)
+        {
+            uint64_t pte = node[(w << 6) + __builtin_ctzll(bits)];
+            if (is_valid_pte(pte) && !is_huge_pte(pte))
+            {
+                node_meta(get_frame_number(pte))->sharers++;
+            }
+        }
+    }
 }
 
-int get_index(uint64_t vpn, int level)
+/**
+ * Gives a table its own copy of the node at the given level that it shares with clones,
+ * before writing through it, and returns the copy's frame.
+ */
+static uint64_t unshare_node(uint64_t frame, int level)
 {
-    int offset = SYMBOL_BITS * (PT_LEVELS - (level + 1));
-    return (vpn >> offset) & SYMBOL_MASK;
+    uint64_t copy = alloc_node();
+
+    copy_node(frame, copy, level);
+    node_meta(frame)->sharers--;
+    return copy;
 }
 
 /**
- * Returns a pointer to a Page Table leaf (represents the actual mapping entry of a vpn to a ppn)
- * If there is no such mapping, returns NULL
+ * Returns the frame of the page table node at the given level on the path of vpn (level 0 is the root).
+ * In Insert mode missing nodes are allocated, otherwise NO_MAPPING is returned when the path ends early,
+ * and *reached (if not NULL) is set to the level of the deepest existing node.
+ * Huge blocks on the path are split in Insert and Destroy modes, and end the path in Search mode.
+ * Insert and Destroy walks also copy the nodes the table shares with clones, so the path they
+ * return is the table's own.
  */
-uint64_t *page_walk(uint64_t pt, uint64_t vpn, enum walk_mode mode)
+uint64_t walk_node(uint64_t pt, uint64_t vpn, int level, enum walk_mode mode, int *reached)
 {
     int index;
     uint64_t *node;
-    uint64_t *pte_ptr;
+    uint64_t pte;
+    uint64_t root = pt;
+    int start;
+    int cow = (mode != Search) && node_meta(root)->cow;
 
-    for (int i = 0; i < PT_LEVELS; i++)
+    if (cow)
+    {
+        // A cached node may be shared through one of its ancestors, only a walk from the root can tell
+        start = 0;
+    }
+    else
+    {
+        // Resume below the deepest node the paging-structure cache remembers for this prefix
+        pt = psc_lookup(root, vpn, level, &start);
+    }
+
+    for (int i = start; i < level; i++)
     {
         // Obtain the symbol from the vpn at each pt level, and slide the "mask window" to the right.
         index = get_index(vpn, i);
@@ -65,63 +134,889 @@ uint64_t *page_walk(uint64_t pt, uint64_t vpn, enum walk_mode mode)
         // Get the page table node
         node = (uint64_t *)phys_to_virt(pt << OFFSET_BITS);
 
-        // Get the page table entry pointer
-        pte_ptr = &(node[index]);
+        // Get the page table entry
+        pte = load_pte(&node[index]);
 
         // Check for mapping
-        if (!is_valid_pte(*pte_ptr))
+        if (!is_valid_pte(pte))
         {
-            if (mode == Insert)
+            if (mode != Insert)
             {
-                // Prevent from allocating new frame the last level
-                if (i == PT_LEVELS - 1)
+                if (reached != NULL)
                 {
-                    return pte_ptr;
+                    *reached = i;
                 }
+                return NO_MAPPING;
+            }
 
-                // Create a new pte
-                uint64_t new_frame = alloc_page_frame();
-                *pte_ptr = create_pte(new_frame);
+            // Create a new pte
+            uint64_t new_frame = alloc_node();
+            if (!install_pte(pt, node, index, pte, create_pte(new_frame)))
+            {
+                // Another thread has changed the entry first, give the node back and look at it again
+                free_node(new_frame);
+                i--;
+                continue;
             }
-            else
+            pte = create_pte(new_frame);
+        }
+        else if (is_huge_pte(pte))
+        {
+            if (mode == Search)
+            {
+                if (reached != NULL)
+                {
+                    *reached = i;
+                }
+                return NO_MAPPING;
+            }
+
+            // Only part of the block changes, so it has to be broken into smaller ones
+            uint64_t split = split_huge_pte(pte, i);
+            if (!install_pte(pt, node, index, pte, split))
             {
-                return NULL;
+                free_node(get_frame_number(split));
+                i--;
+                continue;
             }
+            pte = split;
+        }
+        else if (cow && node_meta(get_frame_number(pte))->sharers > 0)
+        {
+            pte = create_pte(unshare_node(get_frame_number(pte), i + 1));
+            store_pte(pt, node, index, pte);
+            psc_invalidate(root, vpn, i + 1);
         }
 
         // Update the pt to one level ahead
-        pt = get_frame_number(*pte_ptr);
+        pt = get_frame_number(pte);
+        psc_fill(root, vpn, i + 1, pt);
+    }
+    return pt;
+}
+
+/**
+ * Frees the node at the given level on the path of vpn if it has no valid entries left,
+ * and keeps going up while its ancestors become empty as well. The root is never freed.
+ */
+static void reclaim_path(uint64_t pt, uint64_t vpn, int level)
+{
+    uint64_t path[PT_LEVELS]; // path[i] = frame of the node at level i
+    int i;
+
+    // Lock-free readers may still be walking through an empty node, and nothing tells when they are done
+    if (pt_concurrent)
+    {
+        return;
+    }
+
+    path[0] = pt;
+    for (i = 0; i < level; i++)
+    {
+        uint64_t pte = ((uint64_t *)phys_to_virt(path[i] << OFFSET_BITS))[get_index(vpn, i)];
+        if (!is_valid_pte(pte) || is_huge_pte(pte))
+        {
+            return;
+        }
+        path[i + 1] = get_frame_number(pte);
+    }
+
+    for (i = level; i > 0 && node_meta(path[i])->live == 0; i--)
+    {
+        free_node(path[i]);
+        store_pte(path[i - 1], (uint64_t *)phys_to_virt(path[i - 1] << OFFSET_BITS), get_index(vpn, i - 1), 0ULL);
+    }
+
+    if (i < level)
+    {
+        // The freed nodes must not be reached through the paging-structure cache anymore
+        psc_invalidate(pt, vpn, i + 1);
+    }
+}
+
+/**
+ * Returns a pointer to the leaf that maps vpn - a pte of the last level, or a huge pte above it -
+ * and sets *level to the level it was found at and *pte to the value it was read as.
+ * If there is no such mapping, returns NULL.
+ */
+uint64_t *find_leaf(uint64_t pt, uint64_t vpn, int *level, uint64_t *pte)
+{
+    uint64_t root = pt;
+    int start;
+
+    pt = psc_lookup(root, vpn, PT_LEVELS - 1, &start);
+
+    for (int i = start; i < PT_LEVELS; i++)
+    {
+        uint64_t *node = (uint64_t *)phys_to_virt(pt << OFFSET_BITS);
+        uint64_t *pte_ptr = &node[get_index(vpn, i)];
+
+        // Read every entry once, so that a concurrent writer can't change it between the checks
+        *pte = load_pte(pte_ptr);
+        if (!is_valid_pte(*pte))
+        {
+            return NULL;
+        }
+        if (i == PT_LEVELS - 1 || is_huge_pte(*pte))
+        {
+            *level = i;
+            return pte_ptr;
+        }
+        pt = get_frame_number(*pte);
+        psc_fill(root, vpn, i + 1, pt);
+    }
+    return NULL;
+}
+
+/**
+ * Returns a pointer to a Page Table leaf (represents the actual mapping entry of a vpn to a ppn)
+ * and sets *frame to the frame of the leaf node that holds it.
+ * If there is no such mapping, returns NULL
+ */
+uint64_t *page_walk(uint64_t pt, uint64_t vpn, enum walk_mode mode, uint64_t *frame)
+{
+    // The last level holds the mappings themselves, so no frame is allocated for it
+    *frame = walk_node(pt, vpn, PT_LEVELS - 1, mode, NULL);
+    if (*frame == NO_MAPPING)
+    {
+        return NULL;
+    }
+
+    uint64_t *pte_ptr = &((uint64_t *)phys_to_virt(*frame << OFFSET_BITS))[get_index(vpn, PT_LEVELS - 1)];
+    if (!is_valid_pte(*pte_ptr) && mode != Insert)
+    {
+        return NULL;
     }
     return pte_ptr; // Returns a pte leaf that represents the actual mapping of the vpn
 }
 
+/**
+ * Returns a pointer to the leaf of vpn found at the given level, which the table doesn't share
+ * with clones: shared nodes on the path are copied first, so that flags written into the leaf
+ * don't show in the clones.
+ */
+static uint64_t *own_leaf(uint64_t pt, uint64_t vpn, int level)
+{
+    uint64_t frame = walk_node(pt, vpn, level, Destroy, NULL);
+    return &((uint64_t *)phys_to_virt(frame << OFFSET_BITS))[get_index(vpn, level)];
+}
+
+/**
+ * Sets flags in the leaf that find_leaf returned for vpn.
+ */
+static void set_leaf_flags(uint64_t pt, uint64_t vpn, int level, uint64_t *pte_ptr, uint64_t pte, uint64_t flags)
+{
+    if ((pte & flags) != flags && node_meta(pt)->cow)
+    {
+        pte_ptr = own_leaf(pt, vpn, level);
+    }
+    set_pte_flags(pte_ptr, pte, flags);
+}
+
+/**
+ * page_table_query of the tables that aren't of the default geometry.
+ */
+static uint64_t kind_query(uint64_t pt, uint64_t vpn)
+{
+    switch (table_kind(pt))
+    {
+    case PT_KIND_HASHED:
+        return hashed_query(pt, vpn);
+    case PT_KIND_COMPRESSED:
+        return compressed_query(pt, vpn);
+    case PT_KIND_SNAPSHOT:
+        return snapshot_query(pt, vpn);
+    default:
+        return geometry_query(pt, vpn);
+    }
+}
+
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
 {
     uint64_t *pte_leaf_ptr;
+    uint64_t frame;
+    int index = get_index(vpn, PT_LEVELS - 1);
+
+    if (trace_enabled)
+    {
+        trace_record((ppn == NO_MAPPING) ? PT_TRACE_UNMAP : PT_TRACE_UPDATE, pt, vpn, ppn);
+    }
+    if (table_kind(pt) == PT_KIND_SNAPSHOT)
+        errx(1, "page_table_update: snapshots are read-only");
+    if (table_kind(pt) != PT_GEOMETRY_DEFAULT)
+    {
+        // The other kinds of tables don't return the old pte, the reverse map asks for it
+        uint64_t old_ppn = rmap_enabled ? kind_query(pt, vpn) : NO_MAPPING;
+        if (table_kind(pt) == PT_KIND_HASHED)
+        {
+            hashed_update(pt, vpn, ppn);
+        }
+        else if (table_kind(pt) == PT_KIND_COMPRESSED)
+        {
+            compressed_update(pt, vpn, ppn);
+        }
+        else
+        {
+            geometry_update(pt, vpn, ppn);
+        }
+        if (rmap_enabled)
+        {
+            rmap_update(pt, vpn, old_ppn, ppn);
+        }
+        return;
+    }
 
     if (ppn == NO_MAPPING)
     {
         // Destroy vpn mapping
-        pte_leaf_ptr = page_walk(pt, vpn, Destroy);
+        pte_leaf_ptr = page_walk(pt, vpn, Destroy, &frame);
         if (pte_leaf_ptr != NULL)
         {
-            *pte_leaf_ptr = 0ULL;
+            if (rmap_enabled)
+            {
+                rmap_update(pt, vpn, get_frame_number(*pte_leaf_ptr), NO_MAPPING);
+            }
+            store_pte(frame, pte_leaf_ptr - index, index, 0ULL);
+            if (node_meta(frame)->live == 0)
+            {
+                reclaim_path(pt, vpn, PT_LEVELS - 1);
+            }
         }
     }
     else
     {
         // Set vpn mapping to ppn
-        pte_leaf_ptr = page_walk(pt, vpn, Insert);
-        *pte_leaf_ptr = create_pte(ppn);
+        pte_leaf_ptr = page_walk(pt, vpn, Insert, &frame);
+        if (rmap_enabled)
+        {
+            rmap_update(pt, vpn, is_valid_pte(*pte_leaf_ptr) ? get_frame_number(*pte_leaf_ptr) : NO_MAPPING, ppn);
+        }
+        store_pte(frame, pte_leaf_ptr - index, index, create_pte(ppn));
+    }
+
+    // Keep the translation cache coherent with the new mapping. While the accessed bits are
+    // tracked, the fresh pte's bit is clear and only a walk sets it, so the entry goes instead
+    tlb_update(pt, vpn, pt_access_tracking ? NO_MAPPING : ppn);
+}
+
+/**
+ * Maps count consecutive vpns starting at vpn to the ppns starting at ppn.
+ */
+static void map_range(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t count)
+{
+    while (count > 0)
+    {
+        // One walk per leaf node, then fill its entries in a single (vectorizable) loop
+        int first = get_index(vpn, PT_LEVELS - 1);
+        uint64_t chunk = (count < (uint64_t)(SYMBOL_MASK + 1 - first)) ? count : SYMBOL_MASK + 1 - first;
+        uint64_t frame = walk_node(pt, vpn, PT_LEVELS - 1, Insert, NULL);
+        uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+        uint64_t *restrict ptes = node + first;
+        uint64_t added = 0;
+
+        for (uint64_t j = 0; rmap_enabled && j < chunk; j++)
+        {
+            rmap_update(pt, vpn + j, is_valid_pte(ptes[j]) ? get_frame_number(ptes[j]) : NO_MAPPING, ppn + j);
+        }
+
+        if (pt_concurrent)
+        {
+            for (uint64_t j = 0; j < chunk; j++)
+            {
+                store_pte(frame, node, first + j, create_pte(ppn + j));
+            }
+        }
+        else
+        {
+            for (uint64_t j = 0; j < chunk; j++)
+            {
+                added += ~ptes[j] & VALID_MASK;
+                ptes[j] = create_pte(ppn + j);
+            }
+            node_meta(frame)->live += added;
+            mark_occupancy(frame, first, chunk, 1);
+        }
+
+        vpn += chunk;
+        ppn += chunk;
+        count -= chunk;
     }
 }
 
+void page_table_unmap_range(uint64_t pt, uint64_t vpn, uint64_t count)
+{
+    uint64_t end = vpn + count;
+    uint64_t first_vpn = vpn;
+    int reached = 0;
+
+    require_default(pt, "page_table_unmap_range");
+
+    while (vpn < end)
+    {
+        // A huge block that the range covers whole is cleared as one entry, instead of being split
+        int level;
+        uint64_t pte;
+        if ((vpn & (level_span(PT_LEVEL_2M) - 1)) == 0 && end - vpn >= level_span(PT_LEVEL_2M) &&
+            find_leaf(pt, vpn, &level, &pte) != NULL && level < PT_LEVELS - 1 &&
+            (vpn & (level_span(level) - 1)) == 0 && end - vpn >= level_span(level))
+        {
+            uint64_t frame = walk_node(pt, vpn, level, Destroy, NULL);
+            store_pte(frame, (uint64_t *)phys_to_virt(frame << OFFSET_BITS), get_index(vpn, level), 0ULL);
+            if (node_meta(frame)->live == 0)
+            {
+                reclaim_path(pt, vpn, level);
+            }
+            vpn += level_span(level);
+            continue;
+        }
+
+        uint64_t frame = walk_node(pt, vpn, PT_LEVELS - 1, Destroy, &reached);
+        if (frame == NO_MAPPING)
+        {
+            // Nothing is mapped below the missing node, skip the whole span it would have covered
+            uint64_t span = level_span(reached);
+            vpn = (vpn & ~(span - 1)) + span;
+            continue;
+        }
+
+        int first = get_index(vpn, PT_LEVELS - 1);
+        uint64_t chunk = end - vpn;
+        if (chunk > (uint64_t)(SYMBOL_MASK + 1 - first))
+        {
+            chunk = SYMBOL_MASK + 1 - first;
+        }
+
+        uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+        uint64_t *restrict ptes = node + first;
+        uint64_t cleared = 0;
+
+        for (uint64_t j = 0; rmap_enabled && j < chunk; j++)
+        {
+            if (is_valid_pte(ptes[j]))
+            {
+                rmap_update(pt, vpn + j, get_frame_number(ptes[j]), NO_MAPPING);
+            }
+        }
+
+        if (pt_concurrent)
+        {
+            for (uint64_t j = 0; j < chunk; j++)
+            {
+                store_pte(frame, node, first + j, 0ULL);
+            }
+        }
+        else
+        {
+            for (uint64_t j = 0; j < chunk; j++)
+            {
+                cleared += ptes[j] & VALID_MASK;
+                ptes[j] = 0ULL;
+            }
+            mark_occupancy(frame, first, chunk, 0);
+        }
+
+        struct node_meta *meta = node_meta(frame);
+        meta->live -= cleared;
+        if (meta->live == 0)
+        {
+            reclaim_path(pt, vpn, PT_LEVELS - 1);
+        }
+        vpn += chunk;
+    }
+
+    tlb_invalidate_range(pt, first_vpn, count);
+}
+
+void page_table_update_range(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t count)
+{
+    if (ppn == NO_MAPPING)
+    {
+        page_table_unmap_range(pt, vpn, count);
+        return;
+    }
+
+    require_default(pt, "page_table_update_range");
+
+    map_range(pt, vpn, ppn, count);
+    tlb_invalidate_range(pt, vpn, count);
+}
+
+void page_table_update_huge(uint64_t pt, uint64_t vpn, uint64_t ppn, int level)
+{
+    uint64_t span = level_span(level);
+
+    require_default(pt, "page_table_update_huge");
+    if (rmap_enabled)
+        errx(1, "page_table_update_huge: huge mappings can't be kept in the reverse map");
+
+    if (level != PT_LEVEL_2M && level != PT_LEVEL_1G)
+        errx(1, "huge mappings are only supported at levels %d and %d", PT_LEVEL_2M, PT_LEVEL_1G);
+    if ((vpn & (span - 1)) != 0 || (ppn != NO_MAPPING && (ppn & (span - 1)) != 0))
+        errx(1, "huge mapping of vpn %llx to ppn %llx is not aligned to %llu pages", (unsigned long long)vpn,
+             (unsigned long long)ppn, (unsigned long long)span);
+
+    // A larger block on the path is split; when unmapping, a missing path means nothing is mapped
+    uint64_t frame = walk_node(pt, vpn, level, (ppn == NO_MAPPING) ? Destroy : Insert, NULL);
+    if (frame != NO_MAPPING)
+    {
+        uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+        int index = get_index(vpn, level);
+        uint64_t old = load_pte(&node[index]);
+
+        store_pte(frame, node, index, (ppn == NO_MAPPING) ? 0ULL : create_pte(ppn) | HUGE_MASK);
+
+        // Whatever was mapped inside the block (a subtree or another block) is dropped as a whole.
+        // In concurrent mode the subtree is left allocated, as readers may still be walking through it.
+        if (is_valid_pte(old) && !is_huge_pte(old) && !pt_concurrent)
+        {
+            free_subtree(get_frame_number(old), level + 1);
+            psc_invalidate_range(pt, vpn, span);
+        }
+
+        if (node_meta(frame)->live == 0)
+        {
+            reclaim_path(pt, vpn, level);
+        }
+    }
+
+    tlb_invalidate_range(pt, vpn, span);
+}
+
 uint64_t page_table_query(uint64_t pt, uint64_t vpn)
 {
-    uint64_t *pte_leaf_ptr = page_walk(pt, vpn, Search);
+    uint64_t ppn;
+
+    if (trace_enabled)
+    {
+        trace_record(PT_TRACE_QUERY, pt, vpn, 0);
+    }
+    if (table_kind(pt) != PT_GEOMETRY_DEFAULT)
+    {
+        return kind_query(pt, vpn);
+    }
+
+    if (tlb_lookup(pt, vpn, &ppn))
+    {
+        return ppn;
+    }
+
+    int level;
+    uint64_t pte;
+    uint64_t *pte_leaf_ptr = find_leaf(pt, vpn, &level, &pte);
     if (pte_leaf_ptr != NULL)
     {
-        return get_frame_number(*pte_leaf_ptr);
+        if (pt_access_tracking)
+        {
+            set_leaf_flags(pt, vpn, level, pte_leaf_ptr, pte, ACCESSED_MASK);
+        }
+        ppn = leaf_ppn(pte, vpn, level);
+        tlb_fill(pt, vpn, ppn);
+        return ppn;
     }
     return NO_MAPPING;
+}
+
+void pt_set_access_tracking(int on)
+{
+    if (on && !pt_access_tracking)
+    {
+        // Translations cached before would keep hitting without ever setting the bit
+        pt_tlb_flush();
+    }
+    pt_access_tracking = on;
+}
+
+uint64_t page_table_translate_write(uint64_t pt, uint64_t vpn)
+{
+    int level;
+    uint64_t pte;
+
+    require_default(pt, "page_table_translate_write");
+
+    // Always walks: the TLB doesn't remember whether the pte is dirty already
+    uint64_t *pte_leaf_ptr = find_leaf(pt, vpn, &level, &pte);
+    if (pte_leaf_ptr == NULL)
+    {
+        return NO_MAPPING;
+    }
+    set_leaf_flags(pt, vpn, level, pte_leaf_ptr, pte, ACCESSED_MASK | DIRTY_MASK);
+    return leaf_ppn(pte, vpn, level);
+}
+
+void page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t *ppns, size_t n)
+{
+    uint64_t path[PT_LEVELS]; // path[i] = frame of the node at level i on the previous walk
+    int depth = 1;            // Number of valid nodes in path (the root is always valid)
+    uint64_t prev = 0;
+
+    require_default(pt, "page_table_query_batch");
+
+    path[0] = pt;
+
+    for (size_t k = 0; k < n; k++)
+    {
+        uint64_t vpn = vpns[k];
+        uint64_t pte = 0;
+        int i = depth - 1;
+
+        // Find the deepest node of the previous walk that this vpn passes through as well
+        while (i > 0 && get_prefix(vpn, i) != get_prefix(prev, i))
+        {
+            i--;
+        }
+
+        for (; i < PT_LEVELS; i++)
+        {
+            uint64_t *node = (uint64_t *)phys_to_virt(path[i] << OFFSET_BITS);
+            pte = load_pte(&node[get_index(vpn, i)]);
+            if (!is_valid_pte(pte) || i == PT_LEVELS - 1 || is_huge_pte(pte))
+            {
+                break;
+            }
+            path[i + 1] = get_frame_number(pte);
+        }
+
+        ppns[k] = is_valid_pte(pte) ? leaf_ppn(pte, vpn, i) : NO_MAPPING;
+        depth = i + 1;
+        prev = vpn;
+    }
+}
+
+uint64_t page_table_clone(uint64_t pt)
+{
+    require_default(pt, "page_table_clone");
+    if (pt_concurrent)
+        errx(1, "page_table_clone: tables can't be cloned in concurrent mode");
+    if (rmap_enabled)
+        errx(1, "page_table_clone: clones can't be kept in the reverse map");
+
+    // Only the root is copied, everything below it is shared until one of the tables writes to it
+    uint64_t clone = alloc_page_frame();
+    *node_meta(clone) = (struct node_meta){0};
+    copy_node(pt, clone, 0);
+    node_meta(pt)->cow = 1;
+    node_meta(clone)->cow = 1;
+    return clone;
+}
+
+/**
+ * Visitor of the leaves that for_each_in_node finds, which also gets the leaf pte itself.
+ */
+typedef int (*leaf_fn)(uint64_t *pte_ptr, uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg);
+
+/**
+ * page_table_for_each below the node in frame at the given level, whose first entry maps base.
+ */
+static int for_each_in_node(uint64_t frame, int level, uint64_t base, uint64_t lo, uint64_t hi, leaf_fn visit,
+                            void *arg)
+{
+    uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+    uint64_t *occupancy = node_meta(frame)->occupancy;
+    uint64_t span = level_span(level);
+    uint64_t first = (lo > base) ? (lo - base) / span : 0;
+    uint64_t last = (hi - 1 - base) / span;
+
+    if (last > SYMBOL_MASK)
+    {
+        last = SYMBOL_MASK;
+    }
+
+    for (uint64_t w = first >> 6; w <= last >> 6; w++)
+    {
+        // Keep the bits of the entries in [first, last] only, then visit them lowest first
+        uint64_t bits = occupancy[w];
+        if (w == first >> 6)
+            bits &= ~0ULL << (first & 63);
+        if (w == last >> 6 && (last & 63) != 63)
+            bits &= (1ULL << ((last & 63) + 1)) - 1;
+
+        for (; bits != 0; bits &= bits - 1)
+        {
+            int index = (w << 6) + __builtin_ctzll(bits);
+            uint64_t pte = load_pte(&node[index]);
+            uint64_t entry_base = base + index * span;
+            int rc;
+
+            if (!is_valid_pte(pte))
+            {
+                continue;
+            }
+            if (level == PT_LEVELS - 1 || is_huge_pte(pte))
+            {
+                uint64_t start = (entry_base > lo) ? entry_base : lo;
+                uint64_t end = (entry_base + span < hi) ? entry_base + span : hi;
+                rc = visit(&node[index], start, get_frame_number(pte) + (start - entry_base), end - start, arg);
+            }
+            else
+            {
+                rc = for_each_in_node(get_frame_number(pte), level + 1, entry_base, lo, hi, visit, arg);
+            }
+            if (rc != 0)
+            {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+struct visit_adapter
+{
+    pt_visit_fn visit;
+    void *arg;
+};
+
+static int visit_leaf(uint64_t *pte_ptr, uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg)
+{
+    struct visit_adapter *adapter = arg;
+    return adapter->visit(vpn, ppn, pages, adapter->arg);
+}
+
+int page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi, pt_visit_fn visit, void *arg)
+{
+    uint64_t vpn_end = 1ULL << (SYMBOL_BITS * PT_LEVELS);
+    struct visit_adapter adapter = {visit, arg};
+
+    require_default(pt, "page_table_for_each");
+
+    if (vpn_hi > vpn_end)
+    {
+        vpn_hi = vpn_end;
+    }
+    if (vpn_lo >= vpn_hi)
+    {
+        return 0;
+    }
+    return for_each_in_node(pt, 0, 0, vpn_lo, vpn_hi, visit_leaf, &adapter);
+}
+
+void pt_scan_init(struct pt_scan *scan, uint64_t pt)
+{
+    require_default(pt, "pt_scan_init");
+    scan->pt = pt;
+    scan->hand = 0;
+}
+
+struct scan_slice
+{
+    struct pt_scan *scan;
+    uint64_t budget;
+    uint64_t visited;
+    pt_harvest_fn harvest;
+    void *arg;
+};
+
+static int scan_leaf(uint64_t *pte_ptr, uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg)
+{
+    struct scan_slice *slice = arg;
+    uint64_t pt = slice->scan->pt;
+    uint64_t bits;
+
+    if (node_meta(pt)->cow && (*pte_ptr & (ACCESSED_MASK | DIRTY_MASK)) != 0)
+    {
+        // The bits are cleared in the table's own copy of the leaf, the clones keep theirs.
+        // The walk goes on through the shared nodes, whose bits are still the same up ahead.
+        int level;
+        uint64_t pte;
+        find_leaf(pt, vpn, &level, &pte);
+        pte_ptr = own_leaf(pt, vpn, level);
+    }
+
+    if (pt_concurrent)
+    {
+        bits = __atomic_fetch_and(pte_ptr, ~(ACCESSED_MASK | DIRTY_MASK), __ATOMIC_RELAXED);
+    }
+    else
+    {
+        bits = *pte_ptr;
+        *pte_ptr = bits & ~(ACCESSED_MASK | DIRTY_MASK);
+    }
+    bits &= ACCESSED_MASK | DIRTY_MASK;
+
+    if (bits & ACCESSED_MASK)
+    {
+        // The page must walk again on its next access, to set the bit again
+        tlb_invalidate_range(pt, vpn, pages);
+    }
+    slice->harvest(vpn, pages, bits, slice->arg);
+
+    slice->scan->hand = vpn + pages;
+    return ++slice->visited == slice->budget;
+}
+
+uint64_t page_table_scan(struct pt_scan *scan, uint64_t budget, pt_harvest_fn harvest, void *arg)
+{
+    struct scan_slice slice = {scan, budget, 0, harvest, arg};
+    uint64_t vpn_end = 1ULL << (SYMBOL_BITS * PT_LEVELS);
+
+    if (budget == 0)
+    {
+        return 0;
+    }
+    if (for_each_in_node(scan->pt, 0, 0, scan->hand, vpn_end, scan_leaf, &slice) == 0)
+    {
+        // Went past the last mapping, the next slice starts over
+        scan->hand = 0;
+    }
+    return slice.visited;
+}
+
+void pt_shape_init(struct pt_shape_walk *walk, uint64_t pt)
+{
+    require_default(pt, "pt_shape_init");
+    walk->pt = pt;
+    walk->vpn = 0;
+    walk->level = 0;
+    walk->shape = (struct pt_shape){0};
+}
+
+/**
+ * Accounts the node in frame and the nodes below it, in pre-order, leaving out those before the
+ * walk's position, which an earlier step accounted. chain is the number of single-entry nodes
+ * right above it. Returns nonzero when the budget ran out, with the position at the next node.
+ */
+static int shape_node(uint64_t frame, int level, uint64_t base, int chain, struct pt_shape_walk *walk,
+                      uint64_t *budget)
+{
+    struct pt_shape *shape = &walk->shape;
+    uint64_t *node = (uint64_t *)phys_to_virt(frame << OFFSET_BITS);
+    uint64_t *occupancy = node_meta(frame)->occupancy;
+    uint64_t live = node_meta(frame)->live;
+    uint64_t span = level_span(level);
+    int fresh = base > walk->vpn || (base == walk->vpn && level >= walk->level);
+
+    chain = (live == 1) ? chain + 1 : 0;
+    if (fresh)
+    {
+        if (*budget == 0)
+        {
+            walk->vpn = base;
+            walk->level = level;
+            return 1;
+        }
+        (*budget)--;
+        shape->nodes[level]++;
+        shape->entries[level] += live;
+        shape->frames++;
+        if ((uint64_t)chain > shape->longest_chain)
+        {
+            shape->longest_chain = chain;
+        }
+    }
+
+    for (int w = 0; w < OCCUPANCY_WORDS; w++)
+    {
+        for (uint64_t bits = occupancy[w]; bits != 0; bits &= bits - 1)
+        {
+            int index = (w << 6) + __builtin_ctzll(bits);
+            uint64_t pte = load_pte(&node[index]);
+            uint64_t entry_base = base + index * span;
+
+            if (!is_valid_pte(pte))
+            {
+                continue;
+            }
+            if (level == PT_LEVELS - 1 || is_huge_pte(pte))
+            {
+                // A leaf sits in pre-order where a node below this one would, and a step may
+                // have stopped in a subtree before it
+                if (entry_base > walk->vpn || (entry_base == walk->vpn && level + 1 >= walk->level))
+                {
+                    shape->mappings++;
+                    shape->pages += span;
+                }
+            }
+            else if (entry_base + span > walk->vpn &&
+                     shape_node(get_frame_number(pte), level + 1, entry_base, chain, walk, budget) != 0)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int page_table_shape(struct pt_shape_walk *walk, uint64_t budget)
+{
+    if (shape_node(table_root(walk->pt), 0, 0, 0, walk, &budget) != 0)
+    {
+        return 0;
+    }
+    // Past every node, so that further steps account nothing
+    walk->vpn = NO_MAPPING;
+    return 1;
+}
+
+struct inflight_walk
+{
+    size_t k;      // Index of the vpn being translated, n when the slot is idle
+    int level;     // Level of the node that pte_ptr points into
+    uint64_t *pte_ptr;
+};
+
+/**
+ * Starts translating vpns[k] in the given slot by prefetching its root entry.
+ */
+static void start_walk(struct inflight_walk *walk, uint64_t *root, const uint64_t *vpns, size_t k)
+{
+    walk->k = k;
+    walk->level = 0;
+    walk->pte_ptr = &root[get_index(vpns[k], 0)];
+    __builtin_prefetch(walk->pte_ptr);
+}
+
+void page_table_query_interleaved(uint64_t pt, const uint64_t *vpns, uint64_t *ppns, size_t n,
+                                  unsigned int inflight)
+{
+    require_default(pt, "page_table_query_interleaved");
+
+    struct inflight_walk walks[PT_MAX_INFLIGHT];
+    uint64_t *root = (uint64_t *)phys_to_virt(pt << OFFSET_BITS);
+    size_t next = 0;
+    unsigned int active = 0;
+
+    if (inflight == 0 || inflight > PT_MAX_INFLIGHT)
+        inflight = PT_MAX_INFLIGHT;
+
+    for (unsigned int s = 0; s < inflight; s++)
+    {
+        walks[s].k = n;
+        if (next < n)
+        {
+            start_walk(&walks[s], root, vpns, next++);
+            active++;
+        }
+    }
+
+    // Round-robin between the walks, advancing each by one level per visit
+    for (unsigned int s = 0; active > 0; s = (s + 1 == inflight) ? 0 : s + 1)
+    {
+        struct inflight_walk *walk = &walks[s];
+        if (walk->k == n)
+        {
+            continue;
+        }
+
+        uint64_t pte = load_pte(walk->pte_ptr);
+        if (is_valid_pte(pte) && walk->level < PT_LEVELS - 1 && !is_huge_pte(pte))
+        {
+            uint64_t *node = (uint64_t *)phys_to_virt(get_frame_number(pte) << OFFSET_BITS);
+            walk->level++;
+            walk->pte_ptr = &node[get_index(vpns[walk->k], walk->level)];
+            __builtin_prefetch(walk->pte_ptr);
+            continue;
+        }
+
+        // The walk has finished, reuse its slot for the next vpn
+        ppns[walk->k] = is_valid_pte(pte) ? leaf_ppn(pte, vpns[walk->k], walk->level) : NO_MAPPING;
+        if (next < n)
+        {
+            start_walk(walk, root, vpns, next++);
+        }
+        else
+        {
+            walk->k = n;
+            active--;
+        }
+    }
 }
\ No newline at end of file
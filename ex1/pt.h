@@ -0,0 +1,564 @@
+#ifndef PT_H
+#define PT_H
+
+#include <stddef.h>
+
+#include "os.h"
+
+// 5 levels of PTE
+#define PT_LEVELS 5
+#define SYMBOL_BITS 9
+#define OFFSET_BITS 12
+
+// ---------------------------------- Geometries ----------------------------------
+
+enum pt_geometry
+{
+    PT_GEOMETRY_DEFAULT, // The radix tree of PT_LEVELS levels above, the only one every call supports
+    PT_GEOMETRY_4K_48,   // 4 KiB pages, 4 levels of 9 bits (x86-64 4-level paging)
+    PT_GEOMETRY_4K_57,   // 4 KiB pages, 5 levels of 9 bits (x86-64 5-level paging)
+    PT_GEOMETRY_16K_48,  // 16 KiB pages, 1 + 3 * 11 bits (AArch64 16 KiB granule)
+    PT_GEOMETRY_64K_48,  // 64 KiB pages, 6 + 2 * 13 bits (AArch64 64 KiB granule)
+    PT_GEOMETRIES
+};
+
+struct pt_geometry_info
+{
+    const char *name;
+    int levels;
+    int symbol_bits; // Index bits of every level but the top one
+    int top_bits;    // Index bits of the root
+    int offset_bits; // Page size, so a vpn is an address >> offset_bits
+};
+
+/*
+ * A table handle carries its kind (its geometry, PT_KIND_HASHED, PT_KIND_COMPRESSED or
+ * PT_KIND_SNAPSHOT) above PT_KIND_SHIFT, and its root frame below it, so page_table_update
+ * and page_table_query dispatch on it without touching memory.
+ */
+#define PT_KIND_SHIFT 56
+
+/**
+ * Creates an empty table of the given geometry and returns its handle, to be passed as pt.
+ * Tables of the non-default geometries get their own walkers, unrolled for the geometry and
+ * specialized per operation. They support page_table_update and page_table_query only,
+ * and vpns must fit into the geometry (larger ones are never mapped).
+ * Node frames of wider nodes come from alloc_page_frames.
+ */
+uint64_t page_table_create(enum pt_geometry geometry);
+
+const struct pt_geometry_info *pt_geometry_info(enum pt_geometry geometry);
+
+// --------------------------------- Hashed backend ---------------------------------
+
+#define PT_KIND_HASHED PT_GEOMETRIES
+
+/**
+ * Creates an empty hashed page table and returns its handle, to be passed as pt to
+ * page_table_update and page_table_query (the only calls it supports). Instead of a tree it keeps
+ * one open-addressing hash table of (vpn, ppn) pairs in 64-byte buckets, so a lookup usually reads
+ * a single cache line, and a mapping costs the same 16 bytes (plus slack) however sparse the table is.
+ * Its frames count as node frames. Not available in concurrent mode.
+ */
+uint64_t page_table_create_hashed(void);
+
+// ------------------------------- Compressed backend -------------------------------
+
+#define PT_KIND_COMPRESSED (PT_GEOMETRIES + 1)
+
+/**
+ * Creates an empty compressed table and returns its handle, to be passed as pt to page_table_update
+ * and page_table_query (the only calls it supports). It is the default radix tree with path
+ * compression: an entry may skip the levels that would each hold a single child, so an isolated
+ * mapping costs one node below the root instead of four. Nodes with up to 11 entries are a 128-byte
+ * sorted array rather than a frame, and switch to a full frame (and back) as they fill up and empty.
+ * Its frames count as node frames. Not available in concurrent mode.
+ */
+uint64_t page_table_create_compressed(void);
+
+// ------------------------------------ Snapshots ------------------------------------
+
+#define PT_KIND_SNAPSHOT (PT_GEOMETRIES + 2)
+
+/**
+ * Writes a table of the default geometry to the file at path: a header page and one page per node,
+ * whose entries refer to other nodes by their position in the file.
+ */
+void page_table_save(uint64_t pt, const char *path);
+
+/**
+ * Maps a file written by page_table_save and returns a read-only table handle for it, which
+ * page_table_query walks in place. Nothing is read up front, so loading takes the same time
+ * whatever the size of the table, and the pages of the file are faulted in as queries reach them.
+ */
+uint64_t page_table_load(const char *path);
+
+/**
+ * Unmaps a snapshot returned by page_table_load. Its handle must not be used afterwards.
+ */
+void page_table_unload(uint64_t pt);
+
+// ---------------------------------- Range updates ----------------------------------
+
+/**
+ * Maps the count vpns starting at vpn to the consecutive ppns starting at ppn.
+ * Walks once per leaf node instead of once per page. ppn == NO_MAPPING unmaps the range.
+ */
+void page_table_update_range(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t count);
+
+/**
+ * Removes the mappings of the count vpns starting at vpn, skipping unmapped subtrees.
+ */
+void page_table_unmap_range(uint64_t pt, uint64_t vpn, uint64_t count);
+
+// ------------------------------------ Bulk load ------------------------------------
+
+struct pt_pair
+{
+    uint64_t vpn;
+    uint64_t ppn;
+};
+
+/**
+ * Maps the n pairs, sorted by vpn, into a table of the default geometry. The pairs are split by
+ * root entry between nthreads threads (the caller being one of them), each of which builds its
+ * subtrees in one pass without walking from the root, and the caller then links them into the root.
+ * Root entries that already hold mappings are filled by page_table_update, as is everything
+ * while the reverse map or a trace is on, or in concurrent mode.
+ */
+void page_table_bulk_load(uint64_t pt, const struct pt_pair *pairs, size_t n, unsigned int nthreads);
+
+// ---------------------------------- Huge mappings ----------------------------------
+
+// Levels whose entries can map a whole block instead of pointing at a node
+#define PT_LEVEL_2M (PT_LEVELS - 2) // Blocks of 512 pages
+#define PT_LEVEL_1G (PT_LEVELS - 3) // Blocks of 512^2 pages
+
+/**
+ * Maps the block of pages that starts at vpn to the block that starts at ppn with a single
+ * entry at the given level (PT_LEVEL_2M or PT_LEVEL_1G). Both must be aligned to the block size.
+ * Anything previously mapped inside the block is replaced. ppn == NO_MAPPING unmaps the block.
+ *
+ * Updating a single page inside a huge block later splits the block into the next smaller size.
+ */
+void page_table_update_huge(uint64_t pt, uint64_t vpn, uint64_t ppn, int level);
+
+// ---------------------------------- Batched lookups ----------------------------------
+
+/**
+ * Translates n vpns into ppns[] (NO_MAPPING for unmapped vpns).
+ * Consecutive vpns that share upper symbols reuse the nodes of the previous walk,
+ * so sorted or clustered input costs about one level per lookup.
+ */
+void page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t *ppns, size_t n);
+
+#define PT_MAX_INFLIGHT 32
+
+/**
+ * Translates n unrelated vpns into ppns[], keeping up to inflight (<= PT_MAX_INFLIGHT) walks
+ * in flight. Each step prefetches the next node of one walk and moves on to the next walk,
+ * so the cache misses of independent lookups overlap instead of serializing.
+ */
+void page_table_query_interleaved(uint64_t pt, const uint64_t *vpns, uint64_t *ppns, size_t n,
+                                  unsigned int inflight);
+
+// ------------------------------------- Cloning -------------------------------------
+
+/**
+ * Creates a copy of the table, fork-style, and returns its root. Only the root is copied: every
+ * node below it is shared (and reference counted) until one of the tables updates a mapping
+ * under it, which copies just the nodes on that path. Not available in concurrent mode.
+ */
+uint64_t page_table_clone(uint64_t pt);
+
+// ------------------------------------ Iteration ------------------------------------
+
+/**
+ * Called by page_table_for_each for every mapped run of pages consecutive vpns from vpn, mapped to
+ * consecutive ppns from ppn. pages is 1 for a single mapping, and the (clipped) block size for a
+ * huge one. A nonzero return value stops the walk.
+ */
+typedef int (*pt_visit_fn)(uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg);
+
+/**
+ * Visits the mappings of the vpns in [vpn_lo, vpn_hi) in increasing vpn order. Every node keeps
+ * a bitmap of its valid entries, so empty entries and subtrees are skipped without being read.
+ * Returns the value that stopped the walk, or 0 if it ran to the end.
+ */
+int page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi, pt_visit_fn visit, void *arg);
+
+// ------------------------------- Accessed / dirty bits -------------------------------
+
+// Bits of a leaf pte, next to the valid and huge bits
+#define PT_ACCESSED 0x4
+#define PT_DIRTY 0x8
+
+/**
+ * While on, page_table_query sets the accessed bit of the leaf it translates through
+ * (in tables of the default geometry).
+ * A TLB hit doesn't walk, so it doesn't set the bit. To keep the TLB from hiding accesses, turning
+ * tracking on flushes it, page_table_update drops the translation it changes instead of updating
+ * it, and the scanner drops that of every page whose bit it clears, as an OS shoots down the TLB,
+ * so the next access walks again.
+ * The batched lookups never set it. Each table has bits of its own: setting or clearing them
+ * in a table that shares nodes with clones first copies the shared nodes on the way.
+ */
+void pt_set_access_tracking(int on);
+
+/**
+ * Translates vpn for a write: like page_table_query, but sets both the accessed and the dirty bit.
+ */
+uint64_t page_table_translate_write(uint64_t pt, uint64_t vpn);
+
+/**
+ * Called by page_table_scan for every mapping it passes, with the accessed and dirty bits
+ * (PT_ACCESSED | PT_DIRTY) it had collected since the previous pass.
+ */
+typedef void (*pt_harvest_fn)(uint64_t vpn, uint64_t pages, uint64_t bits, void *arg);
+
+struct pt_scan
+{
+    uint64_t pt;
+    uint64_t hand; // The vpn the next slice starts at
+};
+
+void pt_scan_init(struct pt_scan *scan, uint64_t pt);
+
+/**
+ * Advances the clock hand over at most budget mappings (a huge block counts as one), passing
+ * each one's bits to harvest and clearing them. Returns the number of mappings visited, which is
+ * less than budget when the hand reached the end of the address space and wrapped around.
+ * Translations carry on meanwhile: the bits are cleared one entry at a time, without locks.
+ */
+uint64_t page_table_scan(struct pt_scan *scan, uint64_t budget, pt_harvest_fn harvest, void *arg);
+
+// ----------------------------------- Reverse map -----------------------------------
+
+/**
+ * Starts keeping a map from every ppn to the (pt, vpn) pairs mapped to it, which page_table_update
+ * and the range updates maintain from then on. Mappings made before aren't in it. Huge mappings
+ * and clones can't be tracked, so page_table_update_huge and page_table_clone exit while it's on.
+ * Not available in concurrent mode.
+ */
+void pt_rmap_enable(void);
+
+void pt_rmap_disable(void);
+
+/**
+ * Called by pt_rmap_for_each for every mapping of a frame. It may unmap the vpn it is given;
+ * a nonzero return value stops the walk.
+ */
+typedef int (*pt_rmap_fn)(uint64_t pt, uint64_t vpn, void *arg);
+
+/**
+ * Visits every mapping of ppn, in a time proportional to their number.
+ * Returns the value that stopped the walk, or 0 if it ran to the end.
+ */
+int pt_rmap_for_each(uint64_t ppn, pt_rmap_fn visit, void *arg);
+
+// ------------------------------------- Traces -------------------------------------
+
+enum pt_trace_op
+{
+    PT_TRACE_UPDATE, // page_table_update of vpn to ppn
+    PT_TRACE_UNMAP,  // page_table_update of vpn to NO_MAPPING
+    PT_TRACE_QUERY,  // page_table_query of vpn
+    PT_TRACE_TABLE   // Only in files: the table of the operations that follow
+};
+
+struct pt_trace_record
+{
+    enum pt_trace_op op;
+    uint64_t pt; // The handle the operation was made on while recording
+    uint64_t vpn;
+    uint64_t ppn; // NO_MAPPING for an unmap, whatever the previous update left for a query
+};
+
+/**
+ * Starts recording every page_table_update and page_table_query (of any table) to a new trace
+ * file at path, in a compact delta-encoded format. The other calls aren't recorded.
+ * Not available in concurrent mode.
+ */
+void pt_trace_start(const char *path);
+
+/**
+ * Stops recording and flushes the trace file.
+ */
+void pt_trace_stop(void);
+
+struct pt_trace;
+
+/**
+ * Maps a trace file for reading, and pt_trace_next then decodes its records in order,
+ * returning 0 at the end of the trace.
+ */
+struct pt_trace *pt_trace_open(const char *path);
+int pt_trace_next(struct pt_trace *trace, struct pt_trace_record *record);
+void pt_trace_close(struct pt_trace *trace);
+
+// ---------------------------------- Demand paging ----------------------------------
+
+enum pt_policy
+{
+    PT_POLICY_FIFO,
+    PT_POLICY_CLOCK, // Second chance, on a referenced bit per frame
+    PT_POLICY_LRU,   // Aging counters, the oldest of a few frames at the clock hand goes
+    PT_POLICY_ARC,   // Adaptive replacement cache, balancing recency and frequency
+    PT_POLICIES
+};
+
+struct pt_pager_stats
+{
+    uint64_t accesses;
+    uint64_t faults;
+    uint64_t evictions;
+    uint64_t writebacks; // Evictions of pages written since they were loaded
+    uint64_t fault_ns;   // Time spent handling faults, evictions included
+};
+
+struct pt_pager;
+
+/**
+ * Creates a pager that backs the vpns of pt with a budget of frames physical frames, taken from the
+ * frame allocator up front, and replaces pages by the given policy once they are all in use.
+ * The pager owns the mappings of pt from then on, which must start out empty.
+ */
+struct pt_pager *pt_pager_create(uint64_t pt, uint64_t frames, enum pt_policy policy);
+
+/**
+ * Unmaps every resident page and returns the frames to the allocator.
+ */
+void pt_pager_destroy(struct pt_pager *pager);
+
+/**
+ * Translates an access to vpn (a write if write != 0) and returns its ppn. An unmapped vpn faults:
+ * it gets a free frame, or the frame of the page the policy evicts.
+ */
+uint64_t pt_pager_access(struct pt_pager *pager, uint64_t vpn, int write);
+
+void pt_pager_get_stats(struct pt_pager *pager, struct pt_pager_stats *stats);
+
+// --------------------------------- Address spaces ---------------------------------
+
+// Like x86 PCIDs, the ASID tag of a translation is 12 bits
+#define PT_MAX_ASIDS 4096
+
+struct pt_as_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t switches;
+    uint64_t flushes;       // pt_as_flush and pt_as_flush_all calls
+    uint64_t invalidations; // Entries dropped by pt_as_update
+};
+
+struct pt_as_manager;
+
+/**
+ * Creates a manager of address spaces (tables of the default geometry, identified by ASID) with a
+ * set-associative translation cache that they share, of sets (a power of 2) * ways entries.
+ * Entries are tagged with their ASID, so switching address spaces keeps them.
+ * Not available in concurrent mode.
+ */
+struct pt_as_manager *pt_as_manager_create(unsigned int sets, unsigned int ways);
+
+/**
+ * Destroys every address space of the manager, and the manager.
+ */
+void pt_as_manager_destroy(struct pt_as_manager *m);
+
+/**
+ * Creates an empty address space and returns its ASID, the lowest free one.
+ */
+int pt_as_create(struct pt_as_manager *m);
+
+/**
+ * Frees the table of an address space and its cached translations, and makes its ASID free.
+ */
+void pt_as_destroy(struct pt_as_manager *m, int asid);
+
+/**
+ * Returns the table of an address space, for the calls the manager doesn't wrap. Its mappings
+ * must only be changed through pt_as_update (or followed by pt_as_flush), which keeps the cache.
+ */
+uint64_t pt_as_table(struct pt_as_manager *m, int asid);
+
+/**
+ * Makes asid the address space that pt_as_query and pt_as_update work on. Nothing is flushed.
+ */
+void pt_as_switch(struct pt_as_manager *m, int asid);
+
+/**
+ * page_table_query / page_table_update in the current address space, through the shared cache.
+ */
+uint64_t pt_as_query(struct pt_as_manager *m, uint64_t vpn);
+void pt_as_update(struct pt_as_manager *m, uint64_t vpn, uint64_t ppn);
+
+/**
+ * Drops the cached translations of one address space in constant time, leaving the others' alone.
+ */
+void pt_as_flush(struct pt_as_manager *m, int asid);
+
+/**
+ * Drops every cached translation, as a switch does without ASIDs.
+ */
+void pt_as_flush_all(struct pt_as_manager *m);
+
+void pt_as_get_stats(struct pt_as_manager *m, struct pt_as_stats *stats);
+void pt_as_reset_stats(struct pt_as_manager *m);
+
+// ------------------------------- Nested translation -------------------------------
+
+struct pt_nested_stats
+{
+    uint64_t translations;
+    uint64_t combined_hits;
+    uint64_t walks;      // Translations that missed the combined cache
+    uint64_t nwc_hits;   // Host walks the nested-walk cache saved
+    uint64_t nwc_misses;
+    uint64_t references; // Guest and host entries read by the walks
+};
+
+struct pt_nested;
+
+/**
+ * Creates a guest table of the default geometry whose entries are guest-physical (gppn), translated
+ * by host_pt (a table of the default geometry from gppn to host ppn). Its nodes take the gppns from
+ * table_gppn up, which mustn't hold guest pages; the host maps those it doesn't map yet to fresh frames.
+ * The combined (guest vpn to host ppn) and nested-walk (gppn to host ppn) caches are direct-mapped,
+ * of a power of 2 entries each, and 0 entries turn one off.
+ */
+struct pt_nested *pt_nested_create(uint64_t host_pt, uint64_t table_gppn, unsigned int combined_entries,
+                                   unsigned int nwc_entries);
+
+/**
+ * Frees the caches. The guest nodes stay mapped in the host table, which owns their frames.
+ */
+void pt_nested_destroy(struct pt_nested *n);
+
+/**
+ * Maps guest page gvpn to guest frame gppn, or unmaps it if gppn is NO_MAPPING.
+ */
+void pt_nested_map(struct pt_nested *n, uint64_t gvpn, uint64_t gppn);
+
+/**
+ * Returns the host ppn that gvpn ends at through both tables, or NO_MAPPING if either lacks it.
+ */
+uint64_t pt_nested_translate(struct pt_nested *n, uint64_t gvpn);
+
+/**
+ * Empties both caches. Needed after changing host_pt directly.
+ */
+void pt_nested_flush(struct pt_nested *n);
+
+void pt_nested_get_stats(struct pt_nested *n, struct pt_nested_stats *stats);
+void pt_nested_reset_stats(struct pt_nested *n);
+
+// ------------------------------------ Footprint ------------------------------------
+
+struct pt_footprint
+{
+    uint64_t node_frames;   // Frames currently used as nodes below the roots (of all tables)
+    uint64_t rmap_mappings; // Mappings held by the reverse map
+};
+
+/**
+ * Nodes whose last mapping is removed are freed back to the frame allocator, so node_frames
+ * follows the live set of mappings instead of growing with every mapping ever made.
+ */
+void pt_get_footprint(struct pt_footprint *footprint);
+
+// -------------------------------------- Shape --------------------------------------
+
+struct pt_shape
+{
+    uint64_t nodes[PT_LEVELS];   // Nodes per level, the root being level 0
+    uint64_t entries[PT_LEVELS]; // Valid entries of those nodes: their fill factor is entries / (nodes * 512)
+    uint64_t frames;             // Frames the nodes take up, the root included
+    uint64_t mappings;           // Leaf entries, a huge block counting as one
+    uint64_t pages;              // Pages the mappings cover
+    uint64_t longest_chain;      // Most single-entry nodes in a row on a path down the tree
+};
+
+struct pt_shape_walk
+{
+    uint64_t pt;
+    uint64_t vpn; // The walk resumes at the node of this vpn at this level, in pre-order
+    int level;
+    struct pt_shape shape; // What the steps so far have accounted
+};
+
+void pt_shape_init(struct pt_shape_walk *walk, uint64_t pt);
+
+/**
+ * Accounts at most budget more nodes of a table of the default geometry (with their entries) in
+ * walk->shape, so that even a huge table can be measured a slice at a time. Returns nonzero once
+ * the whole table is in. Changes to the table between the steps only show up in the part of it
+ * not yet walked. Nodes shared with clones are accounted in every table that reaches them.
+ */
+int page_table_shape(struct pt_shape_walk *walk, uint64_t budget);
+
+// ----------------------------- Translation cache (TLB) -----------------------------
+
+struct pt_tlb_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;     // Valid entries replaced by a fill
+    uint64_t invalidations; // Entries dropped by page_table_update
+};
+
+/**
+ * Enables a set-associative translation cache in front of page_table_query.
+ * sets must be a power of 2. Any previously cached translations are dropped.
+ */
+void pt_tlb_enable(unsigned int sets, unsigned int ways);
+
+/**
+ * Disables the translation cache and releases its entries.
+ */
+void pt_tlb_disable(void);
+
+/**
+ * Drops every cached translation (statistics are kept).
+ */
+void pt_tlb_flush(void);
+
+void pt_tlb_get_stats(struct pt_tlb_stats *stats);
+void pt_tlb_reset_stats(void);
+
+// ------------------------------ Paging-structure cache ------------------------------
+
+struct pt_psc_stats
+{
+    uint64_t hits[PT_LEVELS]; // hits[i] = walks that resumed at level i (never counted for i = 0)
+    uint64_t misses;          // Walks that had to start at the root
+    uint64_t invalidations;
+};
+
+/**
+ * Enables a cache of intermediate node frames keyed by VPN prefix, one per level below the root.
+ * A walk then resumes at the deepest cached level instead of the root.
+ * entries (per level) must be a power of 2. Any previously cached nodes are dropped.
+ */
+void pt_psc_enable(unsigned int entries);
+
+void pt_psc_disable(void);
+void pt_psc_flush(void);
+
+void pt_psc_get_stats(struct pt_psc_stats *stats);
+void pt_psc_reset_stats(void);
+
+// ----------------------------------- Concurrency -----------------------------------
+
+/**
+ * Switches every table between single-threaded (on = 0, the default) and concurrent mode.
+ * In concurrent mode any number of threads may update and query tables at the same time:
+ * missing nodes are installed with a compare-and-swap on the parent pte, and queries take no locks
+ * and finish in a bounded number of steps. The price is that nodes are never freed while it is on
+ * (lock-free readers give no point at which an empty node is safe to reuse), and the TLB and the
+ * paging-structure cache are disabled. Must only be called while no other thread uses a table.
+ */
+void pt_set_concurrent(int on);
+
+#endif
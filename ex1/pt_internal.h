@@ -0,0 +1,377 @@
+#ifndef PT_INTERNAL_H
+#define PT_INTERNAL_H
+
+#include "pt.h"
+
+// Internal helpers shared between the page table translation units.
+
+#define PTE_BYTES 8
+
+static const uint64_t SYMBOL_MASK = 0x1FF; // mask of 9 lower bits
+static const uint64_t VALID_MASK = 0x1;    // mask of the LSB
+static const uint64_t HUGE_MASK = 0x2;     // The pte maps a whole block instead of pointing at a node
+static const uint64_t ACCESSED_MASK = PT_ACCESSED;
+static const uint64_t DIRTY_MASK = PT_DIRTY;
+
+extern int pt_concurrent; // Set while tables may be shared between threads, see pt_set_concurrent()
+
+extern int pt_access_tracking; // Set by pt_set_access_tracking()
+
+/**
+ * Reads a pte that another thread may be installing at the same time.
+ */
+static inline uint64_t load_pte(const uint64_t *pte_ptr)
+{
+    return __atomic_load_n(pte_ptr, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Sets flags in a leaf pte, unless they are all set already (to keep the cache line clean).
+ */
+static inline void set_pte_flags(uint64_t *pte_ptr, uint64_t pte, uint64_t flags)
+{
+    if ((pte & flags) == flags)
+        return;
+
+    if (pt_concurrent)
+        __atomic_fetch_or(pte_ptr, flags, __ATOMIC_RELAXED);
+    else
+        *pte_ptr = pte | flags;
+}
+
+/**
+ * Returns whether a pte (= page table entry) is valid.
+ */
+static inline uint64_t is_valid_pte(uint64_t pte)
+{
+    return pte & VALID_MASK;
+}
+
+/**
+ * Returns whether a valid pte above the last level is a leaf that maps a whole block.
+ */
+static inline uint64_t is_huge_pte(uint64_t pte)
+{
+    return pte & HUGE_MASK;
+}
+
+/**
+ * Creates a pte (= page table entry) structure out of a page frame number.
+ */
+static inline uint64_t create_pte(uint64_t frame_number)
+{
+    return (frame_number << OFFSET_BITS) + VALID_MASK;
+}
+
+/**
+ * Gets the page number out of a pte (= page table entry).
+ */
+static inline uint64_t get_frame_number(uint64_t pte)
+{
+    return pte >> OFFSET_BITS;
+}
+
+static inline int get_index(uint64_t vpn, int level)
+{
+    int offset = SYMBOL_BITS * (PT_LEVELS - (level + 1));
+    return (vpn >> offset) & SYMBOL_MASK;
+}
+
+/**
+ * Returns the number of pages covered by a single entry of a node at the given level.
+ */
+static inline uint64_t level_span(int level)
+{
+    return 1ULL << (SYMBOL_BITS * (PT_LEVELS - 1 - level));
+}
+
+/**
+ * Returns the ppn that a leaf pte found at the given level maps vpn to.
+ */
+static inline uint64_t leaf_ppn(uint64_t pte, uint64_t vpn, int level)
+{
+    return get_frame_number(pte) + (vpn & (level_span(level) - 1));
+}
+
+/**
+ * Returns the symbols of the vpn that select the node at the given level (level 0 is the root).
+ */
+static inline uint64_t get_prefix(uint64_t vpn, int level)
+{
+    return vpn >> (SYMBOL_BITS * (PT_LEVELS - level));
+}
+
+/**
+ * Returns the kind of table a handle refers to (see page_table_create), and its root frame.
+ */
+static inline int table_kind(uint64_t pt)
+{
+    return pt >> PT_KIND_SHIFT;
+}
+
+static inline uint64_t table_root(uint64_t pt)
+{
+    return pt & ((1ULL << PT_KIND_SHIFT) - 1);
+}
+
+/**
+ * Scrambles a key for the hash tables and caches (Fibonacci hashing). Every bit of the key
+ * reaches the high bits of the result, which are the ones to index by.
+ */
+static inline uint64_t hash_key(uint64_t key)
+{
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+// ---------------------------------- node.c ----------------------------------
+
+#define OCCUPANCY_WORDS ((1 << SYMBOL_BITS) / 64)
+
+struct node_meta
+{
+    uint16_t live;                       // Number of valid entries in the node
+    uint8_t cow;                         // Roots only: the table shares nodes with clones
+    uint32_t sharers;                    // Parent entries pointing at the node, besides the first one
+    uint64_t prefix;                     // Compressed tables: get_prefix() of the vpns below the node
+    uint64_t occupancy[OCCUPANCY_WORDS]; // Bit i is set while entry i is valid
+};
+
+/**
+ * Returns the metadata of the node that lives in the given frame.
+ * A node wider than a frame keeps its live count in the metadata of its first frame, and the
+ * occupancy of entries 512 * k .. 512 * k + 511 in the metadata of frame + k.
+ */
+struct node_meta *node_meta(uint64_t frame);
+
+/**
+ * Allocates a zeroed node frame.
+ */
+uint64_t alloc_node(void);
+
+/**
+ * Returns a node frame to the frame allocator. Its entries need not be cleared.
+ */
+void free_node(uint64_t frame);
+
+/**
+ * Returns the root frame of a table to the frame allocator, once everything below it is freed.
+ */
+void free_root(uint64_t frame);
+
+/**
+ * Allocates a zeroed node that spans frames contiguous frames (for nodes larger than 4 KiB),
+ * and returns its first frame, which also keys its metadata.
+ */
+uint64_t alloc_wide_node(unsigned int frames);
+
+void free_wide_node(uint64_t frame, unsigned int frames);
+
+/**
+ * Frees the node at the given level together with every node below it.
+ * A node shared with clones only loses a sharer instead, and its children are kept.
+ */
+void free_subtree(uint64_t frame, int level);
+
+/**
+ * Returns the occupancy word that holds the bit of entry index of the node in frame.
+ */
+static inline uint64_t *occupancy_word(uint64_t frame, int index)
+{
+    return &node_meta(frame + (index >> SYMBOL_BITS))->occupancy[(index & SYMBOL_MASK) >> 6];
+}
+
+/**
+ * Updates the live count and the occupancy bit of an entry whose validity changed by delta.
+ */
+static inline void account_pte(uint64_t frame, uint64_t *node, int index, int delta)
+{
+    uint64_t *word = occupancy_word(frame, index);
+    uint64_t bit = 1ULL << (index & 63);
+
+    if (!pt_concurrent)
+    {
+        node_meta(frame)->live += delta;
+        *word = (delta > 0) ? *word | bit : *word & ~bit;
+        return;
+    }
+
+    __atomic_fetch_add(&node_meta(frame)->live, (uint16_t)delta, __ATOMIC_RELAXED);
+
+    // Racing writers may set the bit out of order with their ptes. Whoever writes the bit last
+    // sees the final pte when it checks again, so the bit settles on the entry's final validity.
+    uint64_t valid;
+    do
+    {
+        valid = is_valid_pte(load_pte(&node[index]));
+        if (valid)
+            __atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL);
+        else
+            __atomic_fetch_and(word, ~bit, __ATOMIC_ACQ_REL);
+    } while (is_valid_pte(load_pte(&node[index])) != valid);
+}
+
+/**
+ * Stores pte into entry index of the node that lives in frame, keeping the node's metadata.
+ */
+static inline void store_pte(uint64_t frame, uint64_t *node, int index, uint64_t pte)
+{
+    uint64_t old;
+
+    if (pt_concurrent)
+    {
+        old = __atomic_exchange_n(&node[index], pte, __ATOMIC_ACQ_REL);
+    }
+    else
+    {
+        old = node[index];
+        node[index] = pte;
+    }
+
+    int delta = (int)is_valid_pte(pte) - (int)is_valid_pte(old);
+    if (delta != 0)
+    {
+        account_pte(frame, node, index, delta);
+    }
+}
+
+/**
+ * Stores pte into entry index of the node that lives in frame if the entry still holds expected,
+ * and returns whether it did. Only in concurrent mode can another thread have changed it meanwhile.
+ */
+static inline int install_pte(uint64_t frame, uint64_t *node, int index, uint64_t expected, uint64_t pte)
+{
+    if (!pt_concurrent)
+    {
+        store_pte(frame, node, index, pte);
+        return 1;
+    }
+
+    if (!__atomic_compare_exchange_n(&node[index], &expected, pte, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    int delta = (int)is_valid_pte(pte) - (int)is_valid_pte(expected);
+    if (delta != 0)
+    {
+        account_pte(frame, node, index, delta);
+    }
+    return 1;
+}
+
+/**
+ * Sets (valid != 0) or clears the occupancy bits of count entries from first, within one node frame.
+ * For the bulk stores of the range updates, which keep the live count themselves.
+ */
+static inline void mark_occupancy(uint64_t frame, int first, uint64_t count, int valid)
+{
+    uint64_t *words = node_meta(frame)->occupancy;
+    uint64_t end = first + count;
+
+    for (uint64_t i = first; i < end;)
+    {
+        uint64_t n = (end - i < 64 - (i & 63)) ? end - i : 64 - (i & 63);
+        uint64_t bits = ((n == 64) ? ~0ULL : (1ULL << n) - 1) << (i & 63);
+
+        words[i >> 6] = valid ? words[i >> 6] | bits : words[i >> 6] & ~bits;
+        i += n;
+    }
+}
+
+// ---------------------------------- tlb.c ----------------------------------
+
+/**
+ * Looks up (pt, vpn) in the translation cache. Returns 1 and sets *ppn on a hit.
+ */
+int tlb_lookup(uint64_t pt, uint64_t vpn, uint64_t *ppn);
+
+/**
+ * Caches the translation of (pt, vpn), evicting the least recently used way if needed.
+ */
+void tlb_fill(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+/**
+ * Keeps a cached translation of (pt, vpn) coherent with a new ppn (NO_MAPPING drops it).
+ */
+void tlb_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+/**
+ * Drops the cached translations of count consecutive vpns starting at vpn.
+ */
+void tlb_invalidate_range(uint64_t pt, uint64_t vpn, uint64_t count);
+
+/**
+ * Returns the deepest cached node, no deeper than max_level, on the walk of (pt, vpn)
+ * and sets *level to its level. Falls back to the root (level 0) when nothing is cached.
+ */
+uint64_t psc_lookup(uint64_t pt, uint64_t vpn, int max_level, int *level);
+
+/**
+ * Caches the frame of the node at the given level (1 .. PT_LEVELS - 1) on the walk of (pt, vpn).
+ */
+void psc_fill(uint64_t pt, uint64_t vpn, int level, uint64_t frame);
+
+/**
+ * Drops the cached nodes on the walk of (pt, vpn) from the given level downwards.
+ */
+void psc_invalidate(uint64_t pt, uint64_t vpn, int level);
+
+/**
+ * Drops every cached node of pt that lies inside the count vpns starting at vpn.
+ */
+void psc_invalidate_range(uint64_t pt, uint64_t vpn, uint64_t count);
+
+// -------------------------------- geometry.c --------------------------------
+
+/**
+ * page_table_query / page_table_update of a table created with a non-default geometry.
+ */
+uint64_t geometry_query(uint64_t pt, uint64_t vpn);
+void geometry_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+// -------------------------------- hashed.c --------------------------------
+
+/**
+ * page_table_query / page_table_update of a hashed table.
+ */
+uint64_t hashed_query(uint64_t pt, uint64_t vpn);
+void hashed_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+// ------------------------------- compressed.c -------------------------------
+
+/**
+ * page_table_query / page_table_update of a compressed table.
+ */
+uint64_t compressed_query(uint64_t pt, uint64_t vpn);
+void compressed_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+// -------------------------------- snapshot.c --------------------------------
+
+/**
+ * page_table_query of a loaded snapshot.
+ */
+uint64_t snapshot_query(uint64_t pt, uint64_t vpn);
+
+// --------------------------------- trace.c ---------------------------------
+
+extern int trace_enabled; // Set by pt_trace_start()
+
+/**
+ * Appends an operation to the trace being recorded.
+ */
+void trace_record(enum pt_trace_op op, uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+// --------------------------------- rmap.c ---------------------------------
+
+extern int rmap_enabled; // Set by pt_rmap_enable()
+
+/**
+ * Records in the reverse map that vpn of pt moved from old_ppn to ppn (either may be NO_MAPPING).
+ */
+void rmap_update(uint64_t pt, uint64_t vpn, uint64_t old_ppn, uint64_t ppn);
+
+/**
+ * Returns the number of mappings the reverse map holds.
+ */
+uint64_t rmap_mappings(void);
+
+#endif
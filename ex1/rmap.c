@@ -0,0 +1,186 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+/*
+ * The reverse map is a chained hash table keyed by ppn. Its entries live in one growable array
+ * and are linked by index, so that freed entries can be reused through a free list.
+ */
+
+#define RMAP_NIL UINT32_MAX
+
+struct rmap_entry
+{
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t ppn;
+    uint32_t next; // Next entry of the same bucket (or of the free list)
+};
+
+struct rmap
+{
+    struct rmap_entry *entries;
+    uint32_t capacity; // Entries allocated
+    uint32_t used;     // Entries ever handed out, the free list reuses the rest
+    uint32_t free;     // Head of the free list
+    uint32_t *buckets; // Head entry of every bucket
+    int bucket_bits;
+    uint64_t count; // Mappings held
+};
+
+int rmap_enabled;
+static struct rmap rmap;
+
+static uint32_t *rmap_bucket(uint64_t ppn)
+{
+    return &rmap.buckets[hash_key(ppn) >> (64 - rmap.bucket_bits)];
+}
+
+static void alloc_buckets(int bits)
+{
+    rmap.bucket_bits = bits;
+    rmap.buckets = malloc(sizeof(uint32_t) << bits);
+    if (rmap.buckets == NULL)
+        err(1, "rmap: malloc failed");
+
+    for (uint64_t i = 0; i < (1ULL << bits); i++)
+    {
+        rmap.buckets[i] = RMAP_NIL;
+    }
+}
+
+/**
+ * Doubles the number of buckets, keeping the chains about one entry long.
+ */
+static void grow_buckets(void)
+{
+    uint32_t *old = rmap.buckets;
+    uint64_t old_size = 1ULL << rmap.bucket_bits;
+
+    alloc_buckets(rmap.bucket_bits + 1);
+    for (uint64_t i = 0; i < old_size; i++)
+    {
+        for (uint32_t e = old[i], next; e != RMAP_NIL; e = next)
+        {
+            uint32_t *bucket = rmap_bucket(rmap.entries[e].ppn);
+            next = rmap.entries[e].next;
+            rmap.entries[e].next = *bucket;
+            *bucket = e;
+        }
+    }
+    free(old);
+}
+
+void pt_rmap_enable(void)
+{
+    if (pt_concurrent)
+        errx(1, "rmap: the reverse map can't be kept in concurrent mode");
+
+    pt_rmap_disable();
+    alloc_buckets(10);
+    rmap.free = RMAP_NIL;
+    rmap_enabled = 1;
+}
+
+void pt_rmap_disable(void)
+{
+    free(rmap.entries);
+    free(rmap.buckets);
+    rmap = (struct rmap){0};
+    rmap_enabled = 0;
+}
+
+static void rmap_add(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    uint32_t e = rmap.free;
+
+    if (e != RMAP_NIL)
+    {
+        rmap.free = rmap.entries[e].next;
+    }
+    else
+    {
+        if (rmap.used == rmap.capacity)
+        {
+            if (rmap.capacity == RMAP_NIL - 1)
+                errx(1, "rmap: too many mappings");
+            rmap.capacity = (rmap.capacity != 0) ? rmap.capacity * 2 : 1024;
+            rmap.entries = realloc(rmap.entries, (size_t)rmap.capacity * sizeof(struct rmap_entry));
+            if (rmap.entries == NULL)
+                err(1, "rmap: realloc failed");
+        }
+        e = rmap.used++;
+    }
+
+    uint32_t *bucket = rmap_bucket(ppn);
+    rmap.entries[e] = (struct rmap_entry){pt, vpn, ppn, *bucket};
+    *bucket = e;
+
+    if (++rmap.count > (1ULL << rmap.bucket_bits))
+    {
+        grow_buckets();
+    }
+}
+
+static void rmap_remove(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    for (uint32_t *link = rmap_bucket(ppn); *link != RMAP_NIL; link = &rmap.entries[*link].next)
+    {
+        struct rmap_entry *entry = &rmap.entries[*link];
+        if (entry->ppn == ppn && entry->vpn == vpn && entry->pt == pt)
+        {
+            uint32_t e = *link;
+            *link = entry->next;
+            entry->next = rmap.free;
+            rmap.free = e;
+            rmap.count--;
+            return;
+        }
+    }
+    // Mapped before the reverse map was enabled
+}
+
+void rmap_update(uint64_t pt, uint64_t vpn, uint64_t old_ppn, uint64_t ppn)
+{
+    if (old_ppn == ppn)
+    {
+        return;
+    }
+    if (old_ppn != NO_MAPPING)
+    {
+        rmap_remove(pt, vpn, old_ppn);
+    }
+    if (ppn != NO_MAPPING)
+    {
+        rmap_add(pt, vpn, ppn);
+    }
+}
+
+int pt_rmap_for_each(uint64_t ppn, pt_rmap_fn visit, void *arg)
+{
+    if (!rmap_enabled)
+        errx(1, "rmap: the reverse map is disabled");
+
+    for (uint32_t e = *rmap_bucket(ppn), next; e != RMAP_NIL; e = next)
+    {
+        struct rmap_entry *entry = &rmap.entries[e];
+
+        // Read ahead, visit may well unmap the entry it is given
+        next = entry->next;
+        if (entry->ppn == ppn)
+        {
+            int rc = visit(entry->pt, entry->vpn, arg);
+            if (rc != 0)
+            {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+uint64_t rmap_mappings(void)
+{
+    return rmap.count;
+}
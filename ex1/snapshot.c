@@ -0,0 +1,170 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pt_internal.h"
+
+/*
+ * A snapshot file is a header page followed by the nodes of the table, one page each, children
+ * before their parents. Entries that point at a node hold its index in the file instead of a frame
+ * number, and leaf entries are kept as they are, so a mapped file is walked like the tree itself.
+ * The handle of a loaded snapshot holds its slot in the table below instead of a root frame.
+ */
+
+#define SNAPSHOT_MAGIC 0x544e53505450ULL // "PTPSNT"
+#define SNAPSHOT_VERSION 1
+#define NODE_BYTES (1 << OFFSET_BITS)
+
+struct snapshot_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t levels;
+    uint32_t symbol_bits;
+    uint32_t reserved;
+    uint64_t nodes; // Node pages after the header
+    uint64_t root;  // Index of the root node
+};
+
+struct snapshot
+{
+    const char *base; // The mapped file, NULL once unloaded
+    size_t size;
+    uint64_t nodes;
+    uint64_t root;
+};
+
+static struct snapshot *snapshots;
+static size_t nsnapshots;
+
+// ------------------------------------- Saving -------------------------------------
+
+/**
+ * Writes the subtree of the node in frame after out's current nodes, and returns the node's index.
+ */
+static uint64_t save_node(FILE *out, uint64_t frame, int level, uint64_t *written)
+{
+    uint64_t node[1 << SYMBOL_BITS];
+
+    memcpy(node, phys_to_virt(frame << OFFSET_BITS), sizeof(node));
+    for (int j = 0; level < PT_LEVELS - 1 && j <= SYMBOL_MASK; j++)
+    {
+        if (is_valid_pte(node[j]) && !is_huge_pte(node[j]))
+        {
+            node[j] = create_pte(save_node(out, get_frame_number(node[j]), level + 1, written));
+        }
+    }
+
+    if (fwrite(node, sizeof(node), 1, out) != 1)
+        err(1, "page_table_save: write failed");
+    return (*written)++;
+}
+
+void page_table_save(uint64_t pt, const char *path)
+{
+    struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, PT_LEVELS, SYMBOL_BITS, 0, 0, 0};
+    char page[NODE_BYTES] = {0};
+
+    if (table_kind(pt) != PT_GEOMETRY_DEFAULT)
+        errx(1, "page_table_save: only tables of the default geometry are supported");
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+        err(1, "page_table_save: can't create %s", path);
+
+    // The header page is written last, once the number of nodes is known
+    if (fwrite(page, sizeof(page), 1, out) != 1)
+        err(1, "page_table_save: write failed");
+    header.root = save_node(out, table_root(pt), 0, &header.nodes);
+
+    memcpy(page, &header, sizeof(header));
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(page, sizeof(page), 1, out) != 1)
+        err(1, "page_table_save: write failed");
+    if (fclose(out) != 0)
+        err(1, "page_table_save: can't write %s", path);
+}
+
+// ------------------------------------- Loading -------------------------------------
+
+uint64_t page_table_load(const char *path)
+{
+    struct snapshot snapshot;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        err(1, "page_table_load: can't open %s", path);
+    if (fstat(fd, &st) != 0)
+        err(1, "page_table_load: can't stat %s", path);
+    if (st.st_size < NODE_BYTES)
+        errx(1, "page_table_load: %s is not a snapshot", path);
+
+    snapshot.size = st.st_size;
+    snapshot.base = mmap(NULL, snapshot.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (snapshot.base == MAP_FAILED)
+        err(1, "page_table_load: mmap of %s failed", path);
+    close(fd);
+
+    const struct snapshot_header *header = (const struct snapshot_header *)snapshot.base;
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION)
+        errx(1, "page_table_load: %s is not a snapshot", path);
+    if (header->levels != PT_LEVELS || header->symbol_bits != SYMBOL_BITS)
+        errx(1, "page_table_load: %s has a different table geometry", path);
+    if (header->root >= header->nodes || (header->nodes + 1) * NODE_BYTES != snapshot.size)
+        errx(1, "page_table_load: %s is truncated", path);
+    snapshot.nodes = header->nodes;
+    snapshot.root = header->root;
+
+    snapshots = realloc(snapshots, (nsnapshots + 1) * sizeof(struct snapshot));
+    if (snapshots == NULL)
+        err(1, "page_table_load: realloc failed");
+    snapshots[nsnapshots] = snapshot;
+    return nsnapshots++ | ((uint64_t)PT_KIND_SNAPSHOT << PT_KIND_SHIFT);
+}
+
+static struct snapshot *snapshot_of(uint64_t pt)
+{
+    uint64_t slot = table_root(pt);
+
+    if (slot >= nsnapshots || snapshots[slot].base == NULL)
+        errx(1, "snapshot %llx isn't loaded", (unsigned long long)slot);
+    return &snapshots[slot];
+}
+
+void page_table_unload(uint64_t pt)
+{
+    struct snapshot *snapshot = snapshot_of(pt);
+
+    munmap((void *)snapshot->base, snapshot->size);
+    snapshot->base = NULL;
+}
+
+uint64_t snapshot_query(uint64_t pt, uint64_t vpn)
+{
+    const struct snapshot *snapshot = snapshot_of(pt);
+    uint64_t node = snapshot->root;
+
+    for (int level = 0;; level++)
+    {
+        const uint64_t *entries = (const uint64_t *)(snapshot->base + (node + 1) * NODE_BYTES);
+        uint64_t pte = entries[get_index(vpn, level)];
+
+        if (!is_valid_pte(pte))
+        {
+            return NO_MAPPING;
+        }
+        if (level == PT_LEVELS - 1 || is_huge_pte(pte))
+        {
+            return leaf_ppn(pte, vpn, level);
+        }
+
+        node = get_frame_number(pte);
+        if (node >= snapshot->nodes)
+            errx(1, "snapshot %llx is corrupt", (unsigned long long)table_root(pt));
+    }
+}
@@ -0,0 +1,1363 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pt.h"
+
+#include "math.h"
+
+#define VPN_MASK 0x1FFFFFFFFFFF
+#define PPN_MASK 0xFFFFFFFFFFFFF
+
+// TESTS FUNCTIONS
+
+void assert_equal(uint64_t received, uint64_t expected)
+{
+    static int counter = 0;
+
+    if (expected != received)
+    {
+        printf("\n\033[0;31mFailed test!\nExpected \033[0m\033[0;32m%llX\033[0m\033[0;31m and received "
+               "\033[0m\033[0;33m%llX\033[0m\033[0;31m.\033[0m\n",
+               (long long unsigned int)expected, (long long unsigned int)received);
+
+        void *callstack[128];
+        int i, frames = backtrace(callstack, 128);
+        char **strs = backtrace_symbols(callstack, frames);
+        printf("\033[0;36m(Almost readable) stacktrace\n");
+        for (i = 0; i < frames; ++i)
+        {
+            printf("%s\n", strs[i]);
+        }
+        printf("\033[0m\n");
+        free(strs);
+
+        assert(0);
+    }
+
+    if (counter % 500 == 0)
+        printf("\033[0;32m.\033[0m");
+    counter++;
+}
+
+uint64_t get_random(uint64_t mask)
+{
+    return rand() & mask;
+}
+
+int in_array(uint64_t *arr, int size, uint64_t value)
+{
+    for (int i = 0; i < size; i++)
+        if (arr[i] == value)
+            return 1;
+    return 0;
+}
+
+void get_random_list(uint64_t **out, int size, uint64_t mask)
+{
+    *out = calloc(size, sizeof(uint64_t));
+    uint64_t *arr = *out;
+    int count = 0;
+    uint64_t val;
+
+    while (count < size)
+    {
+        val = get_random(mask);
+
+        if (!in_array(arr, count, val))
+        {
+            arr[count] = val;
+            count++;
+        }
+    }
+}
+
+uint64_t get_random_vpn()
+{
+    return get_random(VPN_MASK);
+}
+
+uint64_t get_random_ppn()
+{
+    return get_random(VPN_MASK);
+}
+
+void update_random_and_check(uint64_t pt)
+{
+    uint64_t vpn = get_random_vpn();
+    uint64_t ppn = get_random_ppn();
+
+    if (rand() % 10 < 3)
+        ppn = NO_MAPPING;
+
+    page_table_update(pt, vpn, ppn);
+    assert_equal(page_table_query(pt, vpn), ppn);
+}
+
+void update_many_with_prefix(uint64_t pt)
+{
+    int prefix = (rand() % 45) + 1;
+    uint64_t mask = pow(2, prefix + 1) - 1;
+    uint64_t vpn_mask = pow(2, (45 - prefix) + 1) - 1;
+    int amount = (rand() % 20) + 2;
+
+    if (amount > vpn_mask / 2)
+        amount = vpn_mask / 2;
+
+    uint64_t block = get_random(mask) << prefix;
+    uint64_t *vpn_arr;
+    uint64_t *ppn_arr = malloc(sizeof(uint64_t) * amount);
+
+    get_random_list(&vpn_arr, amount, vpn_mask);
+    for (int i = 0; i < amount; i++)
+    {
+        vpn_arr[i] = block + vpn_arr[i];
+        ppn_arr[i] = get_random_ppn();
+
+        page_table_update(pt, vpn_arr[i], ppn_arr[i]);
+        assert_equal(page_table_query(pt, vpn_arr[i]), ppn_arr[i]);
+    }
+
+    for (int i = 0; i < amount; i++)
+    {
+        uint64_t value = page_table_query(pt, vpn_arr[i]);
+        uint64_t expected = ppn_arr[i];
+        if (value != expected)
+        {
+            printf("Set values:\n");
+            for (int j = 0; j < amount; j++)
+                printf("page_table[%llX] = %llX\n", (long long unsigned int)vpn_arr[j],
+                       (long long unsigned int)ppn_arr[j]);
+            printf("\nFailed on index %d,\ngot value %llX instead of %llX\n", i, (long long unsigned int)value,
+                   (long long unsigned int)expected);
+            assert(0);
+        }
+    }
+
+    free(vpn_arr);
+    free(ppn_arr);
+}
+
+void perform_random_move(uint64_t pt)
+{
+    int option = rand() % 2;
+
+    switch (option)
+    {
+    case 0:
+        update_random_and_check(pt);
+        break;
+    case 1:
+        update_many_with_prefix(pt);
+        break;
+    }
+}
+
+void test_tlb(uint64_t pt)
+{
+    struct pt_tlb_stats stats;
+
+    // A tiny cache, so that evictions and invalidations are exercised by the random moves
+    pt_tlb_enable(16, 4);
+
+    page_table_update(pt, 0xbeef, 0xf00d);
+    assert_equal(page_table_query(pt, 0xbeef), 0xf00d);
+    page_table_update(pt, 0xbeef, 0xcafe);
+    assert_equal(page_table_query(pt, 0xbeef), 0xcafe);
+    page_table_update(pt, 0xbeef, NO_MAPPING);
+    assert_equal(page_table_query(pt, 0xbeef), NO_MAPPING);
+
+    for (int i = 0; i < 4096; i++)
+    {
+        perform_random_move(pt);
+    }
+
+    pt_tlb_get_stats(&stats);
+    assert(stats.hits > 0 && stats.evictions > 0);
+    pt_tlb_disable();
+}
+
+void test_psc(uint64_t pt)
+{
+    struct pt_psc_stats stats;
+
+    pt_psc_enable(64);
+
+    // Neighbouring vpns share all the upper levels, so the second walk resumes at the leaf level
+    page_table_update(pt, 0x1234000, 0xf00d);
+    page_table_update(pt, 0x1234001, 0xcafe);
+    assert_equal(page_table_query(pt, 0x1234000), 0xf00d);
+    assert_equal(page_table_query(pt, 0x1234001), 0xcafe);
+    page_table_update(pt, 0x1234000, NO_MAPPING);
+    assert_equal(page_table_query(pt, 0x1234000), NO_MAPPING);
+    assert_equal(page_table_query(pt, 0x1234001), 0xcafe);
+
+    for (int i = 0; i < 4096; i++)
+    {
+        perform_random_move(pt);
+    }
+
+    pt_psc_get_stats(&stats);
+    assert(stats.hits[PT_LEVELS - 1] > 0 && stats.misses > 0);
+    pt_psc_disable();
+}
+
+void test_query_batch(uint64_t pt)
+{
+    uint64_t vpns[1024];
+    uint64_t ppns[1024];
+
+    // Sorted runs with holes, followed by unrelated random vpns
+    for (int i = 0; i < 1024; i++)
+    {
+        vpns[i] = (i < 768) ? 0x5a5a000 + i * 3 : get_random_vpn();
+        if (i < 768 && i % 4 != 0)
+            page_table_update(pt, vpns[i], get_random_ppn());
+    }
+
+    page_table_query_batch(pt, vpns, ppns, 1024);
+    for (int i = 0; i < 1024; i++)
+    {
+        assert_equal(ppns[i], page_table_query(pt, vpns[i]));
+    }
+
+    page_table_query_interleaved(pt, vpns, ppns, 1024, 4);
+    for (int i = 0; i < 1024; i++)
+    {
+        assert_equal(ppns[i], page_table_query(pt, vpns[i]));
+    }
+}
+
+void test_range(uint64_t pt)
+{
+    uint64_t base = 0x7000000 - 100; // Crosses leaf node boundaries on both ends
+
+    page_table_update_range(pt, base, 0x40000, 2000);
+    for (uint64_t i = 0; i < 2000; i += 7)
+    {
+        assert_equal(page_table_query(pt, base + i), 0x40000 + i);
+    }
+    assert_equal(page_table_query(pt, base + 2000), NO_MAPPING);
+
+    page_table_unmap_range(pt, base + 10, 1000);
+    assert_equal(page_table_query(pt, base + 9), 0x40000 + 9);
+    assert_equal(page_table_query(pt, base + 10), NO_MAPPING);
+    assert_equal(page_table_query(pt, base + 1009), NO_MAPPING);
+    assert_equal(page_table_query(pt, base + 1010), 0x40000 + 1010);
+
+    // Unmapping across missing subtrees must skip them rather than allocate
+    page_table_update_range(pt, base, NO_MAPPING, 1ULL << 40);
+    assert_equal(page_table_query(pt, base + 1999), NO_MAPPING);
+}
+
+void test_huge(uint64_t pt)
+{
+    uint64_t vpn_2m = 0x3ULL << 27;
+    uint64_t vpn_1g = 0x5ULL << 27;
+    uint64_t vpns[4] = {vpn_2m, vpn_2m + 511, vpn_1g + 0x12345, vpn_1g + 0x3ffff};
+    uint64_t ppns[4];
+
+    page_table_update_huge(pt, vpn_2m, 0x200, PT_LEVEL_2M);
+    assert_equal(page_table_query(pt, vpn_2m + 17), 0x200 + 17);
+    assert_equal(page_table_query(pt, vpn_2m + 512), NO_MAPPING);
+
+    // Touching a single page splits the block, but the rest of it stays mapped
+    page_table_update(pt, vpn_2m + 5, 0xf00d);
+    page_table_update(pt, vpn_2m + 6, NO_MAPPING);
+    assert_equal(page_table_query(pt, vpn_2m + 4), 0x200 + 4);
+    assert_equal(page_table_query(pt, vpn_2m + 5), 0xf00d);
+    assert_equal(page_table_query(pt, vpn_2m + 6), NO_MAPPING);
+
+    page_table_update_huge(pt, vpn_2m, NO_MAPPING, PT_LEVEL_2M);
+    assert_equal(page_table_query(pt, vpn_2m + 4), NO_MAPPING);
+
+    page_table_update_huge(pt, vpn_1g, 0x40000, PT_LEVEL_1G);
+    page_table_update_huge(pt, vpn_2m, 0x200, PT_LEVEL_2M);
+    page_table_query_batch(pt, vpns, ppns, 4);
+    assert_equal(ppns[1], 0x200 + 511);
+    assert_equal(ppns[2], 0x40000 + 0x12345);
+    page_table_query_interleaved(pt, vpns, ppns, 4, 2);
+    assert_equal(ppns[0], 0x200);
+    assert_equal(ppns[3], 0x40000 + 0x3ffff);
+
+    // Unmapping a 2M block inside a 1G block splits only the 1G one
+    page_table_update_huge(pt, vpn_1g + 0x200, NO_MAPPING, PT_LEVEL_2M);
+    assert_equal(page_table_query(pt, vpn_1g + 0x1ff), 0x40000 + 0x1ff);
+    assert_equal(page_table_query(pt, vpn_1g + 0x200), NO_MAPPING);
+    assert_equal(page_table_query(pt, vpn_1g + 0x400), 0x40000 + 0x400);
+
+    page_table_update_huge(pt, vpn_1g, NO_MAPPING, PT_LEVEL_1G);
+    assert_equal(page_table_query(pt, vpn_1g + 0x400), NO_MAPPING);
+    page_table_update_huge(pt, vpn_2m, NO_MAPPING, PT_LEVEL_2M);
+
+    // A range unmap clears the blocks it covers whole without splitting them, and splits the others
+    struct pt_footprint before, after;
+    page_table_update_huge(pt, vpn_1g, 0x40000, PT_LEVEL_1G);
+    page_table_update_huge(pt, vpn_2m, 0x200, PT_LEVEL_2M);
+    // (In concurrent mode nothing is reclaimed, so the footprint shows whatever the unmap allocated)
+    pt_set_concurrent(1);
+    pt_get_footprint(&before);
+    page_table_unmap_range(pt, vpn_1g, 1ULL << 18);
+    pt_get_footprint(&after);
+    pt_set_concurrent(0);
+    assert_equal(page_table_query(pt, vpn_1g + 0x12345), NO_MAPPING);
+    assert_equal(after.node_frames, before.node_frames);
+    pt_get_footprint(&before);
+    page_table_unmap_range(pt, vpn_2m, 0x100);
+    pt_get_footprint(&after);
+    assert_equal(page_table_query(pt, vpn_2m + 0xff), NO_MAPPING);
+    assert_equal(page_table_query(pt, vpn_2m + 0x100), 0x300);
+    assert_equal(after.node_frames, before.node_frames + 1);
+    page_table_unmap_range(pt, vpn_2m, 0x200);
+}
+
+void test_reclaim(void)
+{
+    struct pt_footprint before, after;
+    uint64_t pt = alloc_page_frame(); // A table of its own, so that the random moves can't interfere
+    uint64_t vpn_base = 0x1ULL << 44;
+
+    pt_get_footprint(&before);
+    for (int round = 0; round < 8; round++)
+    {
+        for (uint64_t i = 0; i < 64; i++)
+        {
+            page_table_update(pt, vpn_base + i * 0x12345677, i);
+        }
+        page_table_update_range(pt, vpn_base + 1000, 0x10, 3000);
+        page_table_update_huge(pt, vpn_base + (1ULL << 30), 0, PT_LEVEL_1G);
+        page_table_update(pt, vpn_base + (1ULL << 30) + 7, 0xf00d);
+
+        for (uint64_t i = 0; i < 64; i++)
+        {
+            page_table_update(pt, vpn_base + i * 0x12345677, NO_MAPPING);
+        }
+        page_table_unmap_range(pt, vpn_base + 1000, 3000);
+        page_table_update_huge(pt, vpn_base + (1ULL << 30), NO_MAPPING, PT_LEVEL_1G);
+
+        // Churn must not grow the table
+        pt_get_footprint(&after);
+        assert_equal(after.node_frames, before.node_frames);
+    }
+    assert_equal(page_table_query(pt, vpn_base + 7 * 0x12345677), NO_MAPPING);
+}
+
+void test_free_frames(void)
+{
+    uint64_t frames[200];
+
+    // More than a thread's cache holds, so frames also travel through the shared free list
+    for (int i = 0; i < 200; i++)
+    {
+        frames[i] = alloc_page_frame();
+        *(uint64_t *)phys_to_virt(frames[i] << 12) = 0xdeadbeef;
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        free_page_frame(frames[i]);
+    }
+    // The calling thread's cache is LIFO, and recycled frames come back zeroed
+    for (int i = 0; i < 200; i++)
+    {
+        uint64_t ppn = alloc_page_frame();
+        if (i == 0)
+            assert_equal(ppn, frames[199]);
+        assert_equal(*(uint64_t *)phys_to_virt(ppn << 12), 0);
+    }
+}
+
+struct frame_job
+{
+    int alloc; // Frames the thread allocates
+    int free;  // Whether it then frees them before exiting
+    uint64_t frames[32];
+};
+
+void *run_frame_job(void *arg)
+{
+    struct frame_job *job = arg;
+
+    for (int i = 0; i < job->alloc; i++)
+    {
+        job->frames[i] = alloc_page_frame();
+    }
+    for (int i = 0; job->free && i < job->alloc; i++)
+    {
+        free_page_frame(job->frames[i]);
+    }
+    return NULL;
+}
+
+void run_frame_thread(struct frame_job *job)
+{
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, run_frame_job, job);
+    pthread_join(thread, NULL);
+}
+
+void test_exited_thread_frames(void)
+{
+    struct frame_job freer = {32, 1}, taker = {1, 0}, checker = {32, 0};
+    int reused = 0;
+
+    // The first thread leaves its frames on top of the shared list when it exits. The second only
+    // allocates, which takes all of them into its cache, and must hand back the ones it didn't use.
+    run_frame_thread(&freer);
+    run_frame_thread(&taker);
+    run_frame_thread(&checker);
+    for (int i = 0; i < 32; i++)
+    {
+        for (int j = 0; j < 32; j++)
+        {
+            reused += checker.frames[i] == freer.frames[j] && freer.frames[j] != taker.frames[0];
+        }
+    }
+    assert_equal(reused, 31);
+}
+
+void test_geometries(void)
+{
+    struct pt_footprint before, after;
+    uint64_t vpns[1000];
+
+    for (int g = PT_GEOMETRY_DEFAULT + 1; g < PT_GEOMETRIES; g++)
+    {
+        const struct pt_geometry_info *info = pt_geometry_info(g);
+        uint64_t vpn_mask = (1ULL << (info->top_bits + info->symbol_bits * (info->levels - 1))) - 1;
+        uint64_t pt = page_table_create(g);
+
+        pt_get_footprint(&before);
+        for (int i = 0; i < 1000; i++)
+        {
+            // Mostly scattered, with some neighbours sharing the last level
+            vpns[i] = (i % 4 == 0) ? (get_random(VPN_MASK) * 0x9E3779B97F4A7C15ULL) & vpn_mask
+                                             : (vpns[i - 1] ^ (i & 7)) & vpn_mask;
+            page_table_update(pt, vpns[i], vpns[i] + 1);
+        }
+        for (int i = 0; i < 1000; i++)
+        {
+            assert_equal(page_table_query(pt, vpns[i]), vpns[i] + 1);
+        }
+        assert_equal(page_table_query(pt, vpn_mask + 1), NO_MAPPING);
+
+        for (int i = 0; i < 1000; i++)
+        {
+            page_table_update(pt, vpns[i], NO_MAPPING);
+            assert_equal(page_table_query(pt, vpns[i]), NO_MAPPING);
+        }
+        pt_get_footprint(&after);
+        assert_equal(after.node_frames, before.node_frames);
+    }
+}
+
+struct visited
+{
+    uint64_t vpns[64];
+    uint64_t ppns[64];
+    uint64_t pages[64];
+    int count;
+    int stop_after;
+};
+
+int record_visit(uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg)
+{
+    struct visited *v = arg;
+
+    v->vpns[v->count] = vpn;
+    v->ppns[v->count] = ppn;
+    v->pages[v->count] = pages;
+    return ++v->count == v->stop_after;
+}
+
+int check_visit(uint64_t vpn, uint64_t ppn, uint64_t pages, void *arg)
+{
+    uint64_t *prev_end = arg;
+
+    assert_equal(vpn >= *prev_end, 1);
+    assert_equal(page_table_query(*(uint64_t *)(prev_end + 1), vpn), ppn);
+    *prev_end = vpn + pages;
+    return 0;
+}
+
+void test_for_each(uint64_t fuzzed_pt)
+{
+    struct visited v = {.stop_after = 64};
+    uint64_t pt = alloc_page_frame();
+    uint64_t base = 0x2ULL << 36;
+
+    // Inserted out of order, across leaves and subtrees, with a huge block in the middle
+    page_table_update(pt, base + 0x40000, 3);
+    page_table_update(pt, base + 5, 1);
+    page_table_update_huge(pt, base + 0x200, 0x1000, PT_LEVEL_2M);
+    page_table_update(pt, base + 0x4ff, 2);
+    page_table_update(pt, base + 0x4ff, NO_MAPPING);
+
+    assert_equal(page_table_for_each(pt, 0, ~0ULL, record_visit, &v), 0);
+    assert_equal(v.count, 3);
+    assert_equal(v.vpns[0], base + 5);
+    assert_equal(v.vpns[1], base + 0x200);
+    assert_equal(v.pages[1], 512);
+    assert_equal(v.vpns[2], base + 0x40000);
+    assert_equal(v.ppns[2], 3);
+
+    // The huge block is clipped to the range
+    v.count = 0;
+    page_table_for_each(pt, base + 0x210, base + 0x220, record_visit, &v);
+    assert_equal(v.count, 1);
+    assert_equal(v.ppns[0], 0x1010);
+    assert_equal(v.pages[0], 0x10);
+
+    // A nonzero return stops the walk
+    v.count = 0;
+    v.stop_after = 2;
+    assert_equal(page_table_for_each(pt, 0, ~0ULL, record_visit, &v), 1);
+    assert_equal(v.count, 2);
+
+    // Everything the fuzzer left behind comes out in order and agrees with page_table_query
+    uint64_t state[2] = {0, fuzzed_pt};
+    page_table_for_each(fuzzed_pt, 0, ~0ULL, check_visit, state);
+}
+
+void test_clone(void)
+{
+    struct pt_footprint before, built, after;
+    uint64_t pt = alloc_page_frame();
+    uint64_t base = 0x3ULL << 38;
+
+    pt_get_footprint(&before);
+    page_table_update_range(pt, base, 0x100, 2000);
+    page_table_update_huge(pt, base + (1ULL << 21), 0, PT_LEVEL_2M);
+    page_table_update(pt, base + (1ULL << 30), 0xf00d);
+    pt_get_footprint(&built);
+
+    // Cloning copies no node, and each write in the clone copies just its own path
+    uint64_t clone = page_table_clone(pt);
+    pt_get_footprint(&after);
+    assert_equal(after.node_frames, built.node_frames);
+
+    page_table_update(clone, base + 5, 0xbeef);
+    pt_get_footprint(&after);
+    assert_equal(after.node_frames, built.node_frames + PT_LEVELS - 1);
+    assert_equal(page_table_query(clone, base + 5), 0xbeef);
+    assert_equal(page_table_query(pt, base + 5), 0x105);
+    assert_equal(page_table_query(clone, base + 6), 0x106);
+
+    page_table_update(clone, base + (1ULL << 30), NO_MAPPING);
+    page_table_update_huge(clone, base + (1ULL << 21), NO_MAPPING, PT_LEVEL_2M);
+    page_table_update(pt, base + (1ULL << 21) + 3, 0xcafe); // Splits the source's block only
+    assert_equal(page_table_query(pt, base + (1ULL << 30)), 0xf00d);
+    assert_equal(page_table_query(clone, base + (1ULL << 30)), NO_MAPPING);
+    assert_equal(page_table_query(pt, base + (1ULL << 21) + 4), 4);
+    assert_equal(page_table_query(pt, base + (1ULL << 21) + 3), 0xcafe);
+    assert_equal(page_table_query(clone, base + (1ULL << 21) + 4), NO_MAPPING);
+
+    // A clone of a clone shares the clone's copies as well
+    uint64_t grandchild = page_table_clone(clone);
+    assert_equal(page_table_query(grandchild, base + 5), 0xbeef);
+    page_table_unmap_range(clone, base, 2000);
+    assert_equal(page_table_query(grandchild, base + 1999), 0x100 + 1999);
+    assert_equal(page_table_query(pt, base + 1999), 0x100 + 1999);
+
+    // Emptying every table frees every node, shared or not
+    page_table_unmap_range(grandchild, base, 1ULL << 31);
+    page_table_unmap_range(pt, base, 1ULL << 31);
+    page_table_unmap_range(clone, base, 1ULL << 31);
+    pt_get_footprint(&after);
+    assert_equal(after.node_frames, before.node_frames);
+}
+
+struct harvest
+{
+    uint64_t vpns[16];
+    uint64_t bits[16];
+    int count;
+};
+
+void record_harvest(uint64_t vpn, uint64_t pages, uint64_t bits, void *arg)
+{
+    struct harvest *h = arg;
+
+    h->vpns[h->count] = vpn;
+    h->bits[h->count] = bits;
+    h->count++;
+}
+
+void test_access_bits(void)
+{
+    struct harvest h = {0};
+    struct pt_scan scan;
+    uint64_t pt = alloc_page_frame();
+    uint64_t base = 0x5ULL << 36;
+
+    for (uint64_t i = 0; i < 4; i++)
+    {
+        page_table_update(pt, base + i * 0x1000, 0x10 + i);
+    }
+    page_table_update_huge(pt, base + (1ULL << 21), 0, PT_LEVEL_2M);
+
+    pt_tlb_enable(64, 4);
+    pt_set_access_tracking(1);
+    assert_equal(page_table_query(pt, base), 0x10);
+    assert_equal(page_table_translate_write(pt, base + 0x2000), 0x12);
+    assert_equal(page_table_query(pt, base + (1ULL << 21) + 9), 9);
+    assert_equal(page_table_translate_write(pt, base + 0x3fff), NO_MAPPING);
+
+    // Two slices of three and two mappings, then the hand wraps around
+    pt_scan_init(&scan, pt);
+    assert_equal(page_table_scan(&scan, 3, record_harvest, &h), 3);
+    assert_equal(page_table_scan(&scan, 3, record_harvest, &h), 2);
+    assert_equal(h.count, 5);
+    assert_equal(h.vpns[1], base + 0x1000);
+    assert_equal(h.bits[0], PT_ACCESSED);
+    assert_equal(h.bits[1], 0);
+    assert_equal(h.bits[2], PT_ACCESSED | PT_DIRTY);
+    assert_equal(h.bits[4], PT_ACCESSED);
+
+    // The bits were cleared, and the TLB forgot the accessed pages so that they are noticed again
+    page_table_query(pt, base);
+    h.count = 0;
+    assert_equal(page_table_scan(&scan, 16, record_harvest, &h), 5);
+    assert_equal(h.bits[0], PT_ACCESSED);
+    assert_equal(h.bits[2], 0);
+    assert_equal(h.bits[4], 0);
+
+    // A block split by a write hands its bits down to the pages
+    page_table_translate_write(pt, base + (1ULL << 21));
+    page_table_update(pt, base + (1ULL << 21) + 1, 0xbeef);
+    h.count = 0;
+    assert_equal(page_table_scan(&scan, 6, record_harvest, &h), 6);
+    assert_equal(h.vpns[4], base + (1ULL << 21));
+    assert_equal(h.bits[4], PT_ACCESSED | PT_DIRTY);
+    assert_equal(h.bits[5], 0);
+
+    // A table and its clone share their nodes, but neither sees the other's bits
+    uint64_t other = alloc_page_frame();
+    for (uint64_t i = 0; i < 4; i++)
+    {
+        page_table_update(other, base + i * 0x1000, 0x20 + i);
+    }
+    uint64_t clone = page_table_clone(other);
+    page_table_query(other, base);
+    page_table_translate_write(clone, base + 0x1000);
+    page_table_query(other, base + 0x2000);
+    page_table_query(clone, base + 0x2000);
+
+    h.count = 0;
+    pt_scan_init(&scan, clone);
+    assert_equal(page_table_scan(&scan, 16, record_harvest, &h), 4);
+    assert_equal(h.bits[0], 0);
+    assert_equal(h.bits[1], PT_ACCESSED | PT_DIRTY);
+    assert_equal(h.bits[2], PT_ACCESSED);
+
+    // Scanning the clone cleared its own bits only
+    h.count = 0;
+    pt_scan_init(&scan, other);
+    assert_equal(page_table_scan(&scan, 16, record_harvest, &h), 4);
+    assert_equal(h.bits[0], PT_ACCESSED);
+    assert_equal(h.bits[1], 0);
+    assert_equal(h.bits[2], PT_ACCESSED);
+    assert_equal(page_table_query(clone, base + 0x3000), 0x23);
+
+    // Translations cached before tracking was on, and remapped ones, are walked again
+    uint64_t fresh = alloc_page_frame();
+    page_table_update(fresh, base, 0x30);
+    page_table_update(fresh, base + 1, 0x31);
+    pt_set_access_tracking(0);
+    page_table_query(fresh, base);
+    pt_set_access_tracking(1);
+    page_table_query(fresh, base);
+    page_table_query(fresh, base + 1);
+    page_table_update(fresh, base + 1, 0x41);
+    for (int i = 0; i < 10; i++)
+    {
+        assert_equal(page_table_query(fresh, base + 1), 0x41);
+    }
+    h.count = 0;
+    pt_scan_init(&scan, fresh);
+    assert_equal(page_table_scan(&scan, 16, record_harvest, &h), 2);
+    assert_equal(h.bits[0], PT_ACCESSED);
+    assert_equal(h.bits[1], PT_ACCESSED);
+
+    pt_set_access_tracking(0);
+    pt_tlb_disable();
+}
+
+void test_hashed(void)
+{
+    uint64_t pt = page_table_create_hashed();
+    uint64_t vpns[4000];
+
+    for (int i = 0; i < 4000; i++)
+    {
+        vpns[i] = (get_random(VPN_MASK) * 0x9E3779B97F4A7C15ULL) & VPN_MASK;
+        page_table_update(pt, vpns[i], i);
+    }
+    for (int i = 0; i < 4000; i++)
+    {
+        assert_equal(page_table_query(pt, vpns[i]), (uint64_t)i);
+    }
+
+    // Churn through many more removals than the table has slots, so that tombstones pile up
+    for (int round = 0; round < 20; round++)
+    {
+        for (int i = round % 2; i < 4000; i += 2)
+        {
+            page_table_update(pt, vpns[i], NO_MAPPING);
+        }
+        for (int i = round % 2; i < 4000; i += 2)
+        {
+            assert_equal(page_table_query(pt, vpns[i]), NO_MAPPING);
+            assert_equal(page_table_query(pt, vpns[i ^ 1]), (uint64_t)(i ^ 1) + (round ? round - 1 : 0));
+            page_table_update(pt, vpns[i], i + round);
+        }
+    }
+    assert_equal(page_table_query(pt, vpns[7]), 7 + 19);
+    assert_equal(page_table_query(pt, ~0ULL), NO_MAPPING);
+}
+
+void test_compressed(void)
+{
+    struct pt_footprint before, after;
+    uint64_t pt = page_table_create_compressed();
+    uint64_t mirror = alloc_page_frame();
+    uint64_t vpns[3000];
+
+    // Scattered mappings share at most a chunk frame between them, instead of 4 frames each
+    pt_get_footprint(&before);
+    for (int i = 0; i < 20; i++)
+    {
+        page_table_update(pt, (uint64_t)i << 36 | 0x12345, i);
+    }
+    pt_get_footprint(&after);
+    assert(after.node_frames - before.node_frames <= 1);
+
+    // Scattered vpns, and dense clusters that expand their nodes, checked against a default table
+    for (int i = 0; i < 3000; i++)
+    {
+        vpns[i] = (i < 1000) ? get_random(VPN_MASK) : (vpns[i % 1000] & ~0x3ffULL) | get_random(0x3ff);
+        page_table_update(pt, vpns[i], i);
+        page_table_update(mirror, vpns[i], i);
+    }
+    for (int round = 0; round < 4; round++)
+    {
+        for (int i = round; i < 3000; i += 2)
+        {
+            page_table_update(pt, vpns[i], NO_MAPPING);
+            page_table_update(mirror, vpns[i], NO_MAPPING);
+        }
+        for (int i = 0; i < 3000; i++)
+        {
+            assert_equal(page_table_query(pt, vpns[i]), page_table_query(mirror, vpns[i]));
+            assert_equal(page_table_query(pt, vpns[i] ^ 0x200), page_table_query(mirror, vpns[i] ^ 0x200));
+        }
+        for (int i = round; i < 3000; i += 3)
+        {
+            page_table_update(pt, vpns[i], i + round);
+            page_table_update(mirror, vpns[i], i + round);
+        }
+    }
+
+    for (int i = 0; i < 3000; i++)
+    {
+        page_table_update(pt, vpns[i], NO_MAPPING);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        assert_equal(page_table_query(pt, (uint64_t)i << 36 | 0x12345), (uint64_t)i);
+        page_table_update(pt, (uint64_t)i << 36 | 0x12345, NO_MAPPING);
+    }
+    for (int i = 0; i < 3000; i++)
+    {
+        assert_equal(page_table_query(pt, vpns[i]), NO_MAPPING);
+    }
+}
+
+void test_snapshot(void)
+{
+    char path[] = "/tmp/pt_snapshot_XXXXXX";
+    uint64_t pt = alloc_page_frame();
+    uint64_t vpns[2000];
+
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    for (int i = 0; i < 2000; i++)
+    {
+        vpns[i] = (i % 2) ? vpns[i - 1] ^ i : get_random(VPN_MASK);
+        page_table_update(pt, vpns[i], i);
+    }
+    page_table_update_huge(pt, 0x7ULL << 18, 0x40000, PT_LEVEL_1G);
+    page_table_update_huge(pt, 0x3ULL << 27, 0x400, PT_LEVEL_2M);
+    page_table_save(pt, path);
+
+    uint64_t snapshot = page_table_load(path);
+    for (int i = 0; i < 2000; i++)
+    {
+        assert_equal(page_table_query(snapshot, vpns[i]), page_table_query(pt, vpns[i]));
+        assert_equal(page_table_query(snapshot, vpns[i] ^ 0x1000), page_table_query(pt, vpns[i] ^ 0x1000));
+    }
+    assert_equal(page_table_query(snapshot, (0x7ULL << 18) + 0x12345), 0x40000 + 0x12345);
+    assert_equal(page_table_query(snapshot, (0x3ULL << 27) + 0x1ff), 0x400 + 0x1ff);
+
+    // The snapshot doesn't follow the table
+    page_table_update(pt, vpns[1], NO_MAPPING);
+    assert_equal(page_table_query(snapshot, vpns[1]), 1);
+
+    page_table_unload(snapshot);
+    unlink(path);
+}
+
+void test_trace(void)
+{
+    char path[] = "/tmp/pt_trace_XXXXXX";
+    uint64_t pt = alloc_page_frame();
+    uint64_t hashed = page_table_create_hashed();
+    struct pt_trace_record expected[300], record;
+    int n = 0;
+
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    pt_trace_start(path);
+    for (int i = 0; i < 100; i++)
+    {
+        uint64_t table = (i % 7 == 0) ? hashed : pt;
+        uint64_t vpn = (i % 3) ? 0x1000 + i : get_random(VPN_MASK);
+
+        page_table_update(table, vpn, i);
+        expected[n++] = (struct pt_trace_record){PT_TRACE_UPDATE, table, vpn, i};
+        page_table_query(table, vpn ^ 1);
+        expected[n++] = (struct pt_trace_record){PT_TRACE_QUERY, table, vpn ^ 1, i};
+        page_table_update(table, vpn, NO_MAPPING);
+        expected[n++] = (struct pt_trace_record){PT_TRACE_UNMAP, table, vpn, NO_MAPPING};
+    }
+    pt_trace_stop();
+
+    // Not recorded anymore
+    page_table_query(pt, 0x1234);
+
+    struct pt_trace *trace = pt_trace_open(path);
+    for (int i = 0; i < n; i++)
+    {
+        assert_equal(pt_trace_next(trace, &record), 1);
+        assert_equal(record.op, expected[i].op);
+        assert_equal(record.pt, expected[i].pt);
+        assert_equal(record.vpn, expected[i].vpn);
+        assert_equal(record.ppn, expected[i].ppn);
+    }
+    assert_equal(pt_trace_next(trace, &record), 0);
+    pt_trace_close(trace);
+    unlink(path);
+}
+
+uint64_t pager_faults(enum pt_policy policy, uint64_t frames, const uint64_t *vpns, int n)
+{
+    struct pt_pager_stats stats;
+    uint64_t pt = alloc_page_frame();
+    struct pt_pager *pager = pt_pager_create(pt, frames, policy);
+
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t ppn = pt_pager_access(pager, vpns[i], i % 3 == 0);
+        assert_equal(page_table_query(pt, vpns[i]), ppn);
+    }
+    pt_pager_get_stats(pager, &stats);
+    assert_equal(stats.accesses, n);
+    assert_equal(stats.evictions, (stats.faults > frames) ? stats.faults - frames : 0);
+    assert(stats.writebacks <= stats.evictions);
+
+    pt_pager_destroy(pager);
+    for (int i = 0; i < n; i++)
+    {
+        assert_equal(page_table_query(pt, vpns[i]), NO_MAPPING);
+    }
+    return stats.faults;
+}
+
+void test_pager(void)
+{
+    // Belady's anomaly: FIFO faults more with 4 frames than with 3
+    uint64_t belady[12] = {1, 2, 3, 4, 1, 2, 5, 1, 2, 3, 4, 5};
+    assert_equal(pager_faults(PT_POLICY_FIFO, 3, belady, 12), 9);
+    assert_equal(pager_faults(PT_POLICY_FIFO, 4, belady, 12), 10);
+
+    // Clock spares 2, referenced again after the hand cleared its bit, where FIFO evicts it
+    uint64_t second_chance[7] = {1, 2, 3, 4, 2, 5, 2};
+    assert_equal(pager_faults(PT_POLICY_CLOCK, 3, second_chance, 7), 5);
+    assert_equal(pager_faults(PT_POLICY_FIFO, 3, second_chance, 7), 6);
+
+    // A working set that fits only faults once per page, whatever the policy
+    uint64_t vpns[6000];
+    for (int i = 0; i < 4000; i++)
+    {
+        vpns[i] = 0x5000 + (i * 7) % 100;
+    }
+    for (int policy = 0; policy < PT_POLICIES; policy++)
+    {
+        assert_equal(pager_faults(policy, 100, vpns, 4000), 100);
+    }
+
+    // A hot set of 50 pages, each accessed twice in a row, interleaved with a long scan:
+    // ARC keeps the hot pages that FIFO and Clock let the scan push out
+    for (int i = 0; i < 6000; i++)
+    {
+        vpns[i] = (i % 3 == 2) ? 0x9000 + i : 0x5000 + (i / 3) % 50;
+    }
+    assert_equal(pager_faults(PT_POLICY_ARC, 80, vpns, 6000), 2000 + 50);
+    assert_equal(pager_faults(PT_POLICY_FIFO, 80, vpns, 6000), 4000);
+    assert_equal(pager_faults(PT_POLICY_CLOCK, 80, vpns, 6000), 4000);
+
+    // Random accesses over 4 times the budget exercise every list of ARC
+    for (int i = 0; i < 4000; i++)
+    {
+        vpns[i] = 0x7000 + get_random(0xff) % ((i % 5) ? 64 : 256);
+    }
+    for (int policy = 0; policy < PT_POLICIES; policy++)
+    {
+        pager_faults(policy, 64, vpns, 4000);
+    }
+}
+
+void test_address_spaces(void)
+{
+    struct pt_as_stats stats;
+    struct pt_footprint before, after;
+    struct pt_as_manager *m = pt_as_manager_create(64, 4);
+    int asids[40];
+
+    pt_get_footprint(&before);
+    for (int i = 0; i < 40; i++)
+    {
+        asids[i] = pt_as_create(m);
+        assert_equal(asids[i], i);
+        pt_as_switch(m, asids[i]);
+        for (int j = 0; j < 8; j++)
+        {
+            pt_as_update(m, 0x1000 + j, i * 100 + j);
+        }
+    }
+
+    // The same vpns translate differently in every address space, and survive the switches
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            pt_as_switch(m, asids[i]);
+            for (int j = 0; j < 8; j++)
+            {
+                assert_equal(pt_as_query(m, 0x1000 + j), i * 100 + j);
+            }
+        }
+    }
+    pt_as_get_stats(m, &stats);
+    assert_equal(stats.misses, 32);
+    assert_equal(stats.hits, 32);
+
+    // An update drops its own entry only, a flush the address space's only
+    pt_as_switch(m, asids[1]);
+    pt_as_update(m, 0x1003, 0x777);
+    assert_equal(pt_as_query(m, 0x1003), 0x777);
+    pt_as_flush(m, asids[2]);
+    pt_as_reset_stats(m);
+    for (int i = 0; i < 4; i++)
+    {
+        pt_as_switch(m, asids[i]);
+        for (int j = 0; j < 8; j++)
+        {
+            assert_equal(pt_as_query(m, 0x1000 + j), (i == 1 && j == 3) ? 0x777 : (uint64_t)(i * 100 + j));
+        }
+    }
+    pt_as_get_stats(m, &stats);
+    assert_equal(stats.misses, 8);
+    pt_as_flush_all(m);
+    assert_equal(pt_as_query(m, 0x1000), 300);
+    pt_as_get_stats(m, &stats);
+    assert_equal(stats.misses, 9);
+
+    // A recycled ASID starts out empty, with nothing cached, even when it gets the same root frame
+    // back. Destroying it leaves the global caches' entries of other tables alone.
+    struct pt_tlb_stats tlb_stats;
+    struct pt_shape_walk walk;
+    uint64_t other = alloc_page_frame();
+    uint64_t old_root = pt_as_table(m, asids[5]);
+
+    pt_tlb_enable(16, 4);
+    page_table_update(other, 0x42, 0x43);
+    page_table_query(other, 0x42);
+    pt_as_switch(m, asids[5]);
+    assert_equal(pt_as_query(m, 0x1002), 502);
+    pt_as_destroy(m, asids[5]);
+    assert_equal(pt_as_create(m), asids[5]);
+    assert_equal(pt_as_table(m, asids[5]), old_root);
+    pt_as_switch(m, asids[5]);
+    assert_equal(pt_as_query(m, 0x1002), NO_MAPPING);
+    pt_shape_init(&walk, old_root);
+    while (!page_table_shape(&walk, 64))
+        ;
+    assert_equal(walk.shape.entries[0], 0);
+
+    pt_tlb_reset_stats();
+    assert_equal(page_table_query(other, 0x42), 0x43);
+    pt_tlb_get_stats(&tlb_stats);
+    assert_equal(tlb_stats.hits, 1);
+    pt_tlb_disable();
+    page_table_update(other, 0x42, NO_MAPPING);
+
+    pt_as_manager_destroy(m);
+    pt_get_footprint(&after);
+    assert_equal(after.node_frames, before.node_frames);
+}
+
+int compare_pairs(const void *a, const void *b)
+{
+    uint64_t x = ((const struct pt_pair *)a)->vpn, y = ((const struct pt_pair *)b)->vpn;
+    return (x > y) - (x < y);
+}
+
+void test_bulk_load(void)
+{
+    struct pt_footprint before, middle, after;
+    int n = 60000;
+    struct pt_pair *pairs = malloc(n * sizeof(struct pt_pair));
+    uint64_t loaded = alloc_page_frame();
+    uint64_t updated = alloc_page_frame();
+
+    // Clusters all over the address space, and a few duplicate vpns (the last pair wins)
+    for (int i = 0; i < n; i++)
+    {
+        pairs[i].vpn = (i % 4) ? (pairs[i - 1].vpn + 1 + i % 3) & VPN_MASK : get_random(VPN_MASK);
+        pairs[i].ppn = i;
+    }
+    pairs[7].vpn = pairs[8].vpn;
+    qsort(pairs, n, sizeof(struct pt_pair), compare_pairs);
+
+    // One root entry already in use goes through page_table_update
+    page_table_update(loaded, pairs[n / 2].vpn ^ 1, 0xabc);
+    page_table_update(updated, pairs[n / 2].vpn ^ 1, 0xabc);
+
+    pt_get_footprint(&before);
+    page_table_bulk_load(loaded, pairs, n, 4);
+    pt_get_footprint(&middle);
+    for (int i = 0; i < n; i++)
+    {
+        page_table_update(updated, pairs[i].vpn, pairs[i].ppn);
+    }
+    pt_get_footprint(&after);
+
+    assert_equal(middle.node_frames - before.node_frames, after.node_frames - middle.node_frames);
+    for (int i = 0; i < n; i++)
+    {
+        assert_equal(page_table_query(loaded, pairs[i].vpn), page_table_query(updated, pairs[i].vpn));
+        assert_equal(page_table_query(loaded, pairs[i].vpn ^ 0x40), page_table_query(updated, pairs[i].vpn ^ 0x40));
+    }
+    assert_equal(page_table_query(loaded, pairs[n / 2].vpn ^ 1), page_table_query(updated, pairs[n / 2].vpn ^ 1));
+
+    // Loaded tables are ordinary ones: their nodes are reclaimed as they empty, down to none
+    // (before counted the path of the first mapping in both tables)
+    for (int i = 0; i < n; i++)
+    {
+        page_table_update(loaded, pairs[i].vpn, NO_MAPPING);
+        page_table_update(updated, pairs[i].vpn, NO_MAPPING);
+    }
+    page_table_update(loaded, pairs[n / 2].vpn ^ 1, NO_MAPPING);
+    page_table_update(updated, pairs[n / 2].vpn ^ 1, NO_MAPPING);
+    pt_get_footprint(&after);
+    assert_equal(after.node_frames, before.node_frames - 2 * (PT_LEVELS - 1));
+    free(pairs);
+}
+
+void test_nested(void)
+{
+    struct pt_nested_stats stats;
+    uint64_t host = alloc_page_frame();
+    uint64_t gvpn = 0x123456789ULL;
+
+    // Guest RAM at gppns [0x100, 0x400), the part from 0x200 as a huge block
+    for (uint64_t gppn = 0x100; gppn < 0x200; gppn++)
+    {
+        page_table_update(host, gppn, 0x5000 + gppn);
+    }
+    page_table_update_huge(host, 0x200, 0x8000, PT_LEVEL_2M);
+
+    // Without caches, every guest node and the page itself cost a whole host walk
+    struct pt_nested *n = pt_nested_create(host, 0x10000, 0, 0);
+    pt_nested_map(n, gvpn, 0x150);
+    pt_nested_map(n, gvpn + 1, 0x2ab);
+    pt_nested_map(n, gvpn + 2, 0x3000);
+    pt_nested_reset_stats(n);
+    assert_equal(pt_nested_translate(n, gvpn), 0x5150);
+    pt_nested_get_stats(n, &stats);
+    assert_equal(stats.references, (PT_LEVELS + 1) * (PT_LEVELS + 1) - 1);
+    assert_equal(pt_nested_translate(n, gvpn + 1), 0x80ab);
+    assert_equal(pt_nested_translate(n, gvpn + 2), NO_MAPPING); // Not in guest RAM
+    assert_equal(pt_nested_translate(n, gvpn + 3), NO_MAPPING);
+    pt_nested_destroy(n);
+
+    // With them, neighbours share the host walks of their guest nodes, and repeats cost nothing
+    n = pt_nested_create(host, 0x20000, 64, 64);
+    for (int i = 0; i < 16; i++)
+    {
+        pt_nested_map(n, gvpn + i, 0x100 + i);
+    }
+    pt_nested_reset_stats(n);
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            assert_equal(pt_nested_translate(n, gvpn + i), 0x5100 + i);
+        }
+    }
+    pt_nested_get_stats(n, &stats);
+    assert_equal(stats.translations, 32);
+    assert_equal(stats.combined_hits, 16);
+    assert_equal(stats.walks, 16);
+    assert(stats.nwc_hits >= 15 * PT_LEVELS);
+    assert(stats.references < 16 * 2 * (PT_LEVELS + 1));
+
+    // Guest updates drop their combined entry, host updates need a flush
+    pt_nested_map(n, gvpn + 3, 0x1ff);
+    assert_equal(pt_nested_translate(n, gvpn + 3), 0x51ff);
+    pt_nested_map(n, gvpn + 4, NO_MAPPING);
+    assert_equal(pt_nested_translate(n, gvpn + 4), NO_MAPPING);
+    page_table_update(host, 0x105, 0x7777);
+    pt_nested_flush(n);
+    assert_equal(pt_nested_translate(n, gvpn + 5), 0x7777);
+    pt_nested_destroy(n);
+}
+
+void measure_shape(uint64_t pt, uint64_t budget, struct pt_shape *shape)
+{
+    struct pt_shape_walk walk;
+
+    pt_shape_init(&walk, pt);
+    while (!page_table_shape(&walk, budget))
+        ;
+    *shape = walk.shape;
+}
+
+void test_shape(void)
+{
+    struct pt_shape shape, sliced;
+    uint64_t pt = alloc_page_frame();
+    uint64_t base = 0x5ULL << 36;
+
+    // A lone mapping hangs off a chain of single-entry nodes from the root down
+    page_table_update(pt, 0x123456789ULL, 0x42);
+    measure_shape(pt, 1 << 20, &shape);
+    for (int level = 0; level < PT_LEVELS; level++)
+    {
+        assert_equal(shape.nodes[level], 1);
+        assert_equal(shape.entries[level], 1);
+    }
+    assert_equal(shape.frames, PT_LEVELS);
+    assert_equal(shape.mappings, 1);
+    assert_equal(shape.longest_chain, PT_LEVELS);
+
+    // A full leaf node, a huge block next to it, and pages spread one per leaf node
+    page_table_update_range(pt, base, 0x1000, 512);
+    page_table_update_huge(pt, base + 512, 0x200000, PT_LEVEL_2M);
+    for (int i = 0; i < 100; i++)
+    {
+        page_table_update(pt, base + (uint64_t)(i + 2) * 512, i);
+    }
+    measure_shape(pt, 1 << 20, &shape);
+    assert_equal(shape.nodes[0], 1);
+    assert_equal(shape.entries[0], 2);
+    assert_equal(shape.nodes[PT_LEVELS - 2], 2);
+    assert_equal(shape.entries[PT_LEVELS - 2], 1 + 102);
+    assert_equal(shape.nodes[PT_LEVELS - 1], 1 + 1 + 100);
+    assert_equal(shape.entries[PT_LEVELS - 1], 1 + 512 + 100);
+    assert_equal(shape.mappings, 1 + 512 + 1 + 100);
+    assert_equal(shape.pages, 1 + 512 + 512 + 100);
+    assert_equal(shape.frames, 1 + 2 * (PT_LEVELS - 2) + 1 + 1 + 100);
+
+    // Walking a node at a time accounts the same
+    measure_shape(pt, 1, &sliced);
+    for (int level = 0; level < PT_LEVELS; level++)
+    {
+        assert_equal(sliced.nodes[level], shape.nodes[level]);
+        assert_equal(sliced.entries[level], shape.entries[level]);
+    }
+    assert_equal(sliced.frames, shape.frames);
+    assert_equal(sliced.mappings, shape.mappings);
+    assert_equal(sliced.pages, shape.pages);
+    assert_equal(sliced.longest_chain, shape.longest_chain);
+
+    page_table_unmap_range(pt, 0, 1ULL << (PT_LEVELS * SYMBOL_BITS));
+    measure_shape(pt, 1, &shape);
+    assert_equal(shape.frames, 1);
+    assert_equal(shape.mappings, 0);
+}
+
+int count_mapping(uint64_t pt, uint64_t vpn, void *arg)
+{
+    (*(int *)arg)++;
+    return 0;
+}
+
+int unmap_mapping(uint64_t pt, uint64_t vpn, void *arg)
+{
+    page_table_update(pt, vpn, NO_MAPPING);
+    return 0;
+}
+
+int rmap_count(uint64_t ppn)
+{
+    int count = 0;
+    pt_rmap_for_each(ppn, count_mapping, &count);
+    return count;
+}
+
+void test_rmap(void)
+{
+    struct pt_footprint footprint;
+    uint64_t pt = alloc_page_frame();
+    uint64_t other = page_table_create(PT_GEOMETRY_4K_48);
+    uint64_t base = 0x6ULL << 36;
+
+    pt_rmap_enable();
+
+    // A frame shared by both tables and several vpns
+    page_table_update(pt, base, 0x77);
+    page_table_update(pt, base + 0x12345, 0x77);
+    page_table_update(other, 0x42, 0x77);
+    assert_equal(rmap_count(0x77), 3);
+
+    page_table_update(pt, base + 0x12345, 0x78);
+    assert_equal(rmap_count(0x77), 2);
+    assert_equal(rmap_count(0x78), 1);
+
+    page_table_update_range(pt, base + 0x1000, 0x1000, 3000);
+    page_table_update_range(pt, base + 0x1800, 0x77, 1);
+    assert_equal(rmap_count(0x1000 + 2000), 1);
+    assert_equal(rmap_count(0x1000 + 0x800), 0);
+    assert_equal(rmap_count(0x77), 3);
+    pt_get_footprint(&footprint);
+    assert_equal(footprint.rmap_mappings, 3 + 3000);
+
+    // Every mapping of a frame can be torn down from the frame alone
+    pt_rmap_for_each(0x77, unmap_mapping, NULL);
+    assert_equal(rmap_count(0x77), 0);
+    assert_equal(page_table_query(pt, base), NO_MAPPING);
+    assert_equal(page_table_query(other, 0x42), NO_MAPPING);
+
+    page_table_unmap_range(pt, base, 1ULL << 20);
+    pt_get_footprint(&footprint);
+    assert_equal(footprint.rmap_mappings, 0);
+
+    // Destroying an address space takes its mappings out of the reverse map
+    struct pt_as_manager *m = pt_as_manager_create(16, 2);
+    pt_as_switch(m, pt_as_create(m));
+    pt_as_update(m, 0x1234, 0x77);
+    assert_equal(rmap_count(0x77), 1);
+    pt_as_manager_destroy(m);
+    assert_equal(rmap_count(0x77), 0);
+
+    pt_rmap_disable();
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_VPNS 4096
+
+struct concurrent_arg
+{
+    uint64_t pt;
+    uint64_t vpn_base;
+    int id;
+};
+
+void *concurrent_insert(void *p)
+{
+    struct concurrent_arg *arg = p;
+
+    // The threads interleave inside the same leaf nodes, so they race on installing every node
+    for (uint64_t i = arg->id; i < CONCURRENT_VPNS; i += CONCURRENT_THREADS)
+    {
+        page_table_update(arg->pt, arg->vpn_base + i, i + 1);
+        assert_equal(page_table_query(arg->pt, arg->vpn_base + i), i + 1);
+    }
+    return NULL;
+}
+
+void test_concurrent(void)
+{
+    struct pt_footprint before, after;
+    struct concurrent_arg args[CONCURRENT_THREADS];
+    pthread_t threads[CONCURRENT_THREADS];
+    uint64_t pt = alloc_page_frame();
+    uint64_t vpn_base = 0x3ULL << 40;
+
+    pt_set_concurrent(1);
+    pt_get_footprint(&before);
+    for (int t = 0; t < CONCURRENT_THREADS; t++)
+    {
+        args[t] = (struct concurrent_arg){pt, vpn_base, t};
+        pthread_create(&threads[t], NULL, concurrent_insert, &args[t]);
+    }
+    for (int t = 0; t < CONCURRENT_THREADS; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    pt_get_footprint(&after);
+    pt_set_concurrent(0);
+
+    for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+    {
+        assert_equal(page_table_query(pt, vpn_base + i), i + 1);
+    }
+    // One node per level above the leaves, plus the leaves: nodes of lost races went back to the allocator
+    assert_equal(after.node_frames - before.node_frames, PT_LEVELS - 2 + CONCURRENT_VPNS / 512);
+}
+
+int main(int argc, char **argv)
+{
+    srand(time(NULL));
+    uint64_t pt = alloc_page_frame();
+
+    assert_equal(page_table_query(pt, 0xcafe), NO_MAPPING);
+    page_table_update(pt, 0xcafe, 0xf00d);
+    assert_equal(page_table_query(pt, 0xcafe), 0xf00d);
+    page_table_update(pt, 0xcafe, NO_MAPPING);
+    assert_equal(page_table_query(pt, 0xcafe), NO_MAPPING);
+
+    for (int i = 0; i < pow(2, 15); i++)
+    {
+        perform_random_move(pt);
+    }
+    test_tlb(pt);
+    test_psc(pt);
+    test_query_batch(pt);
+    test_range(pt);
+    test_huge(pt);
+    test_for_each(pt);
+    test_reclaim();
+    test_clone();
+    test_access_bits();
+    test_hashed();
+    test_compressed();
+    test_snapshot();
+    test_trace();
+    test_pager();
+    test_address_spaces();
+    test_bulk_load();
+    test_nested();
+    test_shape();
+    test_rmap();
+    test_free_frames();
+    test_exited_thread_frames();
+    test_concurrent();
+    test_geometries();
+    printf("\nAll tests passed!\n");
+
+    return 0;
+}
\ No newline at end of file
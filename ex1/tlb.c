@@ -0,0 +1,314 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "pt_internal.h"
+
+struct tlb_entry
+{
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t ppn;
+    uint64_t stamp; // Last use time, 0 means the entry is empty
+};
+
+struct tlb
+{
+    struct tlb_entry *entries; // sets * ways entries, NULL while the cache is disabled
+    unsigned int sets;
+    unsigned int ways;
+    uint64_t clock;
+    struct pt_tlb_stats stats;
+};
+
+static struct tlb tlb;
+
+/**
+ * Returns the first way of the set that (pt, vpn) maps to.
+ */
+static struct tlb_entry *tlb_set(uint64_t pt, uint64_t vpn)
+{
+    // Mix the root into the index so that tables sharing hot VPNs don't thrash the same set
+    uint64_t hash = vpn ^ hash_key(pt);
+    return &tlb.entries[(hash & (tlb.sets - 1)) * tlb.ways];
+}
+
+static struct tlb_entry *tlb_find(struct tlb_entry *set, uint64_t pt, uint64_t vpn)
+{
+    for (unsigned int i = 0; i < tlb.ways; i++)
+    {
+        if (set[i].stamp != 0 && set[i].vpn == vpn && set[i].pt == pt)
+        {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+void pt_tlb_enable(unsigned int sets, unsigned int ways)
+{
+    if (sets == 0 || (sets & (sets - 1)) != 0 || ways == 0)
+        errx(1, "tlb: sets must be a power of 2 and ways must be positive");
+    if (pt_concurrent)
+        errx(1, "tlb: the translation cache can't be used in concurrent mode");
+
+    pt_tlb_disable();
+
+    tlb.entries = calloc((size_t)sets * ways, sizeof(struct tlb_entry));
+    if (tlb.entries == NULL)
+        err(1, "tlb: calloc failed");
+
+    tlb.sets = sets;
+    tlb.ways = ways;
+    tlb.clock = 0;
+}
+
+void pt_tlb_disable(void)
+{
+    free(tlb.entries);
+    tlb.entries = NULL;
+}
+
+void pt_tlb_flush(void)
+{
+    for (size_t i = 0; tlb.entries != NULL && i < (size_t)tlb.sets * tlb.ways; i++)
+    {
+        tlb.entries[i].stamp = 0;
+    }
+}
+
+void pt_tlb_get_stats(struct pt_tlb_stats *stats)
+{
+    *stats = tlb.stats;
+}
+
+void pt_tlb_reset_stats(void)
+{
+    tlb.stats = (struct pt_tlb_stats){0};
+}
+
+int tlb_lookup(uint64_t pt, uint64_t vpn, uint64_t *ppn)
+{
+    if (tlb.entries == NULL)
+        return 0;
+
+    struct tlb_entry *entry = tlb_find(tlb_set(pt, vpn), pt, vpn);
+    if (entry == NULL)
+    {
+        tlb.stats.misses++;
+        return 0;
+    }
+
+    tlb.stats.hits++;
+    entry->stamp = ++tlb.clock;
+    *ppn = entry->ppn;
+    return 1;
+}
+
+void tlb_fill(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    if (tlb.entries == NULL)
+        return;
+
+    struct tlb_entry *set = tlb_set(pt, vpn);
+    struct tlb_entry *victim = &set[0];
+
+    // Pick an empty way, otherwise the least recently used one
+    for (unsigned int i = 0; i < tlb.ways && victim->stamp != 0; i++)
+    {
+        if (set[i].stamp < victim->stamp)
+        {
+            victim = &set[i];
+        }
+    }
+    if (victim->stamp != 0)
+    {
+        tlb.stats.evictions++;
+    }
+
+    victim->pt = pt;
+    victim->vpn = vpn;
+    victim->ppn = ppn;
+    victim->stamp = ++tlb.clock;
+}
+
+void tlb_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    if (tlb.entries == NULL)
+        return;
+
+    struct tlb_entry *entry = tlb_find(tlb_set(pt, vpn), pt, vpn);
+    if (entry == NULL)
+        return;
+
+    if (ppn == NO_MAPPING)
+    {
+        entry->stamp = 0;
+        tlb.stats.invalidations++;
+    }
+    else
+    {
+        entry->ppn = ppn;
+    }
+}
+
+void tlb_invalidate_range(uint64_t pt, uint64_t vpn, uint64_t count)
+{
+    if (tlb.entries == NULL)
+        return;
+
+    size_t size = (size_t)tlb.sets * tlb.ways;
+    if (count < size)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            tlb_update(pt, vpn + i, NO_MAPPING);
+        }
+        return;
+    }
+
+    // Cheaper to sweep the whole cache than to probe every vpn of a large range
+    for (size_t i = 0; i < size; i++)
+    {
+        struct tlb_entry *entry = &tlb.entries[i];
+        if (entry->stamp != 0 && entry->pt == pt && entry->vpn - vpn < count)
+        {
+            entry->stamp = 0;
+            tlb.stats.invalidations++;
+        }
+    }
+}
+
+// ------------------------------ Paging-structure cache ------------------------------
+
+struct psc_entry
+{
+    uint64_t pt;
+    uint64_t prefix;
+    uint64_t frame;
+    int valid;
+};
+
+struct psc
+{
+    struct psc_entry *entries; // (PT_LEVELS - 1) direct mapped arrays, NULL while the cache is disabled
+    unsigned int size;         // Entries per level
+    struct pt_psc_stats stats;
+};
+
+static struct psc psc;
+
+static struct psc_entry *psc_slot(uint64_t pt, uint64_t vpn, int level)
+{
+    uint64_t hash = get_prefix(vpn, level) ^ hash_key(pt);
+    return &psc.entries[(size_t)(level - 1) * psc.size + (hash & (psc.size - 1))];
+}
+
+void pt_psc_enable(unsigned int entries)
+{
+    if (entries == 0 || (entries & (entries - 1)) != 0)
+        errx(1, "psc: entries must be a power of 2");
+    if (pt_concurrent)
+        errx(1, "psc: the paging-structure cache can't be used in concurrent mode");
+
+    pt_psc_disable();
+
+    psc.entries = calloc((size_t)(PT_LEVELS - 1) * entries, sizeof(struct psc_entry));
+    if (psc.entries == NULL)
+        err(1, "psc: calloc failed");
+
+    psc.size = entries;
+}
+
+void pt_psc_disable(void)
+{
+    free(psc.entries);
+    psc.entries = NULL;
+}
+
+void pt_psc_flush(void)
+{
+    for (size_t i = 0; psc.entries != NULL && i < (size_t)(PT_LEVELS - 1) * psc.size; i++)
+    {
+        psc.entries[i].valid = 0;
+    }
+}
+
+void pt_psc_get_stats(struct pt_psc_stats *stats)
+{
+    *stats = psc.stats;
+}
+
+void pt_psc_reset_stats(void)
+{
+    psc.stats = (struct pt_psc_stats){0};
+}
+
+uint64_t psc_lookup(uint64_t pt, uint64_t vpn, int max_level, int *level)
+{
+    *level = 0;
+    if (psc.entries == NULL)
+        return pt;
+
+    for (int i = (max_level < PT_LEVELS - 1) ? max_level : PT_LEVELS - 1; i > 0; i--)
+    {
+        struct psc_entry *slot = psc_slot(pt, vpn, i);
+        if (slot->valid && slot->prefix == get_prefix(vpn, i) && slot->pt == pt)
+        {
+            psc.stats.hits[i]++;
+            *level = i;
+            return slot->frame;
+        }
+    }
+
+    psc.stats.misses++;
+    return pt;
+}
+
+void psc_fill(uint64_t pt, uint64_t vpn, int level, uint64_t frame)
+{
+    if (psc.entries == NULL)
+        return;
+
+    struct psc_entry *slot = psc_slot(pt, vpn, level);
+    slot->pt = pt;
+    slot->prefix = get_prefix(vpn, level);
+    slot->frame = frame;
+    slot->valid = 1;
+}
+
+void psc_invalidate(uint64_t pt, uint64_t vpn, int level)
+{
+    if (psc.entries == NULL)
+        return;
+
+    for (int i = (level > 0) ? level : 1; i < PT_LEVELS; i++)
+    {
+        struct psc_entry *slot = psc_slot(pt, vpn, i);
+        if (slot->valid && slot->prefix == get_prefix(vpn, i) && slot->pt == pt)
+        {
+            slot->valid = 0;
+            psc.stats.invalidations++;
+        }
+    }
+}
+
+void psc_invalidate_range(uint64_t pt, uint64_t vpn, uint64_t count)
+{
+    if (psc.entries == NULL)
+        return;
+
+    for (int i = 1; i < PT_LEVELS; i++)
+    {
+        int shift = SYMBOL_BITS * (PT_LEVELS - i);
+
+        for (unsigned int j = 0; j < psc.size; j++)
+        {
+            struct psc_entry *slot = &psc.entries[(size_t)(i - 1) * psc.size + j];
+            if (slot->valid && slot->pt == pt && (slot->prefix << shift) - vpn < count)
+            {
+                slot->valid = 0;
+                psc.stats.invalidations++;
+            }
+        }
+    }
+}
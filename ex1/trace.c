@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pt_internal.h"
+
+/*
+ * A trace file is an 8-byte magic followed by records. A record starts with its op byte. A table
+ * record then holds the handle that the records after it refer to, as a varint. The others hold
+ * the difference from the previous vpn, zigzag encoded so that small steps either way are short,
+ * and an update also holds the difference from the previous ppn. Runs of neighbouring pages
+ * thus take 3 bytes per operation.
+ */
+
+static const char trace_magic[8] = "PTTRACE1";
+
+int trace_enabled;
+
+static struct
+{
+    FILE *out;
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t ppn;
+} recorder;
+
+struct pt_trace
+{
+    const unsigned char *base;
+    size_t size;
+    size_t pos;
+    struct pt_trace_record last;
+};
+
+static uint64_t zigzag(uint64_t delta)
+{
+    return (delta << 1) ^ -(delta >> 63);
+}
+
+static uint64_t unzigzag(uint64_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+// ------------------------------------ Recording ------------------------------------
+
+static void put_varint(uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+    {
+        putc_unlocked((value & 0x7f) | 0x80, recorder.out);
+    }
+    putc_unlocked(value, recorder.out);
+}
+
+void pt_trace_start(const char *path)
+{
+    if (pt_concurrent)
+        errx(1, "pt_trace_start: operations can't be traced in concurrent mode");
+
+    pt_trace_stop();
+    recorder.out = fopen(path, "wb");
+    if (recorder.out == NULL)
+        err(1, "pt_trace_start: can't create %s", path);
+    setvbuf(recorder.out, NULL, _IOFBF, 1 << 20);
+    fwrite(trace_magic, sizeof(trace_magic), 1, recorder.out);
+
+    // The first operation always names its table
+    recorder.pt = NO_MAPPING;
+    recorder.vpn = 0;
+    recorder.ppn = 0;
+    trace_enabled = 1;
+}
+
+void pt_trace_stop(void)
+{
+    if (recorder.out != NULL && fclose(recorder.out) != 0)
+        err(1, "pt_trace_stop: write failed");
+    recorder.out = NULL;
+    trace_enabled = 0;
+}
+
+void trace_record(enum pt_trace_op op, uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+    if (pt != recorder.pt)
+    {
+        putc_unlocked(PT_TRACE_TABLE, recorder.out);
+        put_varint(pt);
+        recorder.pt = pt;
+    }
+
+    putc_unlocked(op, recorder.out);
+    put_varint(zigzag(vpn - recorder.vpn));
+    recorder.vpn = vpn;
+    if (op == PT_TRACE_UPDATE)
+    {
+        put_varint(zigzag(ppn - recorder.ppn));
+        recorder.ppn = ppn;
+    }
+}
+
+// ------------------------------------- Reading -------------------------------------
+
+struct pt_trace *pt_trace_open(const char *path)
+{
+    struct stat st;
+    struct pt_trace *trace = calloc(1, sizeof(struct pt_trace));
+    if (trace == NULL)
+        err(1, "pt_trace_open: calloc failed");
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        err(1, "pt_trace_open: can't open %s", path);
+    if (fstat(fd, &st) != 0)
+        err(1, "pt_trace_open: can't stat %s", path);
+    if ((size_t)st.st_size < sizeof(trace_magic))
+        errx(1, "pt_trace_open: %s is not a trace", path);
+
+    trace->size = st.st_size;
+    trace->base = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->base == MAP_FAILED)
+        err(1, "pt_trace_open: mmap of %s failed", path);
+    close(fd);
+    madvise((void *)trace->base, trace->size, MADV_SEQUENTIAL);
+
+    if (memcmp(trace->base, trace_magic, sizeof(trace_magic)) != 0)
+        errx(1, "pt_trace_open: %s is not a trace", path);
+    trace->pos = sizeof(trace_magic);
+    return trace;
+}
+
+static uint64_t get_varint(struct pt_trace *trace)
+{
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (trace->pos == trace->size)
+            errx(1, "pt_trace_next: the trace is truncated");
+
+        unsigned char byte = trace->base[trace->pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            return value;
+        }
+    }
+    errx(1, "pt_trace_next: the trace is corrupt");
+}
+
+int pt_trace_next(struct pt_trace *trace, struct pt_trace_record *record)
+{
+    struct pt_trace_record *last = &trace->last;
+
+    while (trace->pos < trace->size)
+    {
+        enum pt_trace_op op = trace->base[trace->pos++];
+        switch (op)
+        {
+        case PT_TRACE_TABLE:
+            last->pt = get_varint(trace);
+            continue;
+        case PT_TRACE_UPDATE:
+            last->vpn += unzigzag(get_varint(trace));
+            last->ppn += unzigzag(get_varint(trace));
+            break;
+        case PT_TRACE_UNMAP:
+        case PT_TRACE_QUERY:
+            last->vpn += unzigzag(get_varint(trace));
+            break;
+        default:
+            errx(1, "pt_trace_next: the trace is corrupt");
+        }
+
+        last->op = op;
+        *record = *last;
+        if (op == PT_TRACE_UNMAP)
+        {
+            record->ppn = NO_MAPPING;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void pt_trace_close(struct pt_trace *trace)
+{
+    munmap((void *)trace->base, trace->size);
+    free(trace);
+}